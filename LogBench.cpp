@@ -0,0 +1,596 @@
+/**
+ * @file LogBench.cpp
+ * @brief Benchmarks of the logger client and LogServer
+ *
+ * Every result is printed to stdout as one JSON object per line, so runs
+ * can be collected and compared by scripts; progress goes to stderr.
+ * The server benchmarks start their own LogServer in a fresh temporary
+ * directory and count what it stored after shutting it down.
+ *
+ * Usage: logbench client [-t threads,...] [-n calls] [-a] [-f] [-c] [-s server] [-- server options]
+ *   Per-call latency (p50/p99/p999) and throughput of the LOG_* macros
+ *   for each thread count and level; DEBUG is filtered out, measuring
+ *   the disabled path. -a: asynchronous mode, -f: binary format,
+ *   -c: compression. Logs to a LogServer started for the run.
+ *
+ *        logbench ingest [-t threads] [-d seconds] [-r datagrams/s] [-b lines] [-s server] [-- server options]
+ *   Floods the server with synthetic UDP datagrams of -b text lines each,
+ *   as fast as possible or at -r datagrams per second in total, and
+ *   reports the ingest rate and the share of records that were lost.
+ *
+ *        logbench loss [-t threads] [-n records] [-a] [-f] [-c] [-s server] [-- server options]
+ *   End-to-end loss: logs numbered records through the client library
+ *   and checks which of them the server stored, separating the drops the
+ *   client counted (GetLogCounters()) from records lost in between.
+ *
+ *   -s     LogServer binary (default ./logserver)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <vector>
+#include "Logger.h"
+
+#define SERVER_IP "127.0.0.1"  // Must match Logger and LogServer
+#define SERVER_PORT 54321
+#define MAX_THREADS 64
+#define FLOOD_BATCH 32         // Datagrams per sendmmsg() of the flood generator
+#define SERVER_START_MS 300    // Time given to a started server to open its sockets
+#define SETTLE_POLL_MS 100     // How often to check whether the server still writes
+
+static const char *server_bin = "./logserver";
+static char **server_args = NULL;  // Options after "--", passed to the server
+static int server_nargs = 0;
+
+// A LogServer started for a benchmark
+struct bench_server {
+    pid_t pid;
+    int menu_fd;              // Its stdin
+    char dir[64];             // Working directory holding its log
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Starts a LogServer in a new temporary directory.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int server_start(struct bench_server *s) {
+    char bin[4096];
+    if (!realpath(server_bin, bin)) {
+        perror(server_bin);
+        return -1;
+    }
+    strcpy(s->dir, "/tmp/logbench.XXXXXX");
+    if (!mkdtemp(s->dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    s->pid = fork();
+    if (s->pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (s->pid == 0) {
+        // The menu is fed through the pipe and its output discarded
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(fds[0], 0);
+        dup2(null_fd, 1);
+        close(fds[0]);
+        close(fds[1]);
+        if (chdir(s->dir) < 0) _exit(127);
+        char **argv = (char **)calloc(server_nargs + 2, sizeof(char *));
+        argv[0] = bin;
+        for (int i = 0; i < server_nargs; i++) argv[i + 1] = server_args[i];
+        execv(bin, argv);
+        perror(bin);
+        _exit(127);
+    }
+    close(fds[0]);
+    s->menu_fd = fds[1];
+    usleep(SERVER_START_MS * 1000);
+    int status;
+    if (waitpid(s->pid, &status, WNOHANG) == s->pid) {
+        fprintf(stderr, "%s exited at startup\n", server_bin);
+        close(s->menu_fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Waits until the server has written everything it received.
+ *
+ * Returns once the stored data stopped growing for two polls, along with
+ * the time the last growth was seen.
+ */
+static uint64_t server_settle(const struct bench_server *s) {
+    char path[128];
+    uint64_t last_change = now_ns();
+    long long last_size = -1;
+    int stable = 0;
+    while (stable < 2) {
+        usleep(SETTLE_POLL_MS * 1000);
+        long long size = 0;
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/server_log.txt", s->dir);
+        if (stat(path, &st) == 0) size += st.st_size;
+        snprintf(path, sizeof(path), "%s/server_log.d", s->dir);
+        DIR *dir = opendir(path);
+        struct dirent *ent;
+        while (dir && (ent = readdir(dir))) {
+            char file[512];
+            snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+            if (stat(file, &st) == 0 && S_ISREG(st.st_mode)) size += st.st_size;
+        }
+        if (dir) closedir(dir);
+        // Segments are pre-allocated; their index files grow with the data
+        if (size != last_size) {
+            last_size = size;
+            last_change = now_ns();
+            stable = 0;
+        } else {
+            stable++;
+        }
+    }
+    return last_change;
+}
+
+/**
+ * @brief Shuts the server down through its menu and waits for it.
+ */
+static void server_stop(struct bench_server *s) {
+    if (write(s->menu_fd, "0\n", 2) < 0) perror("write");
+    close(s->menu_fd);
+    int status;
+    for (int i = 0; i < 50 && waitpid(s->pid, &status, WNOHANG) == 0; i++) usleep(100000);
+    if (kill(s->pid, 0) == 0) {
+        fprintf(stderr, "Server did not shut down, killing it\n");
+        kill(s->pid, SIGKILL);
+        waitpid(s->pid, &status, 0);
+    }
+}
+
+/**
+ * @brief Calls fn for every line the server stored, in server_log.txt or
+ * in uncompressed segments.
+ */
+static void server_lines(const struct bench_server *s, void (*fn)(const char *line, void *arg), void *arg) {
+    char path[512];
+    std::vector<std::string> files;
+    snprintf(path, sizeof(path), "%s/server_log.txt", s->dir);
+    files.push_back(path);
+    snprintf(path, sizeof(path), "%s/server_log.d", s->dir);
+    DIR *dir = opendir(path);
+    struct dirent *ent;
+    while (dir && (ent = readdir(dir))) {
+        size_t n = strlen(ent->d_name);
+        if (n > 4 && strcmp(ent->d_name + n - 4, ".seg") == 0) files.push_back(std::string(path) + "/" + ent->d_name);
+    }
+    if (dir) closedir(dir);
+
+    for (size_t i = 0; i < files.size(); i++) {
+        FILE *f = fopen(files[i].c_str(), "r");
+        if (!f) continue;
+        int segment = i > 0;
+        char line[4096];
+        if (segment) {
+            // Data starts after the header page and ends at the first NUL
+            fseek(f, 4096, SEEK_SET);
+        }
+        while (fgets(line, sizeof(line), f)) {
+            if (segment && line[0] == '\0') break;
+            fn(line, arg);
+        }
+        fclose(f);
+    }
+}
+
+/**
+ * @brief Tears down the temporary directory of a stopped server.
+ */
+static void server_cleanup(const struct bench_server *s) {
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", s->dir);
+    if (system(cmd) != 0) fprintf(stderr, "Could not remove %s\n", s->dir);
+}
+
+/**
+ * @brief Parses a comma-separated list of thread counts.
+ */
+static int parse_threads(const char *text, int *out, int max) {
+    int n = 0;
+    while (*text && n < max) {
+        int t = atoi(text);
+        if (t < 1 || t > MAX_THREADS) return -1;
+        out[n++] = t;
+        text = strchr(text, ',');
+        if (!text) break;
+        text++;
+    }
+    return n;
+}
+
+// Client benchmark ------------------------------------------------------
+
+struct client_worker {
+    pthread_t thread;
+    int level;
+    long calls;
+    pthread_barrier_t *start;
+    uint64_t begin_ns, end_ns;
+    std::vector<uint32_t> lat;  // Per-call latency in ns
+};
+
+static void *client_worker_main(void *arg) {
+    struct client_worker *w = (struct client_worker *)arg;
+    w->lat.resize(w->calls);
+    pthread_barrier_wait(w->start);
+    w->begin_ns = now_ns();
+    for (long i = 0; i < w->calls; i++) {
+        uint64_t t0 = now_ns();
+        switch (w->level) {
+            case DEBUG: LOG_DEBUG("bench call %ld value %d", i, w->level); break;
+            case WARNING: LOG_WARNING("bench call %ld value %d", i, w->level); break;
+            case ERROR: LOG_ERROR("bench call %ld value %d", i, w->level); break;
+            default: LOG_CRITICAL("bench call %ld value %d", i, w->level); break;
+        }
+        uint64_t d = now_ns() - t0;
+        w->lat[i] = d > UINT32_MAX ? UINT32_MAX : (uint32_t)d;
+    }
+    w->end_ns = now_ns();
+    return NULL;
+}
+
+static uint32_t percentile(const std::vector<uint32_t> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+static int bench_client(int nthreads, const int *threads, long calls, int async, int binary, int compress) {
+    static const char *level_names[] = { "DEBUG", "WARNING", "ERROR", "CRITICAL" };
+    struct bench_server srv;
+    int have_server = server_start(&srv) == 0;
+    if (!have_server) fprintf(stderr, "Benchmarking without a server\n");
+
+    if (async) SetLogMode(LOG_MODE_ASYNC);
+    if (binary) SetLogFormat(LOG_FORMAT_BINARY);
+    SetLogCompression(compress);
+    SetLogClientId("logbench", "bench");
+    if (InitializeLog() < 0) {
+        fprintf(stderr, "InitializeLog failed\n");
+        return 1;
+    }
+    SetLogLevel(WARNING);  // DEBUG measures the filtered path
+
+    for (int t = 0; t < nthreads; t++) {
+        for (int level = DEBUG; level <= CRITICAL; level++) {
+            fprintf(stderr, "client: %d threads, %s\n", threads[t], level_names[level]);
+            pthread_barrier_t start;
+            pthread_barrier_init(&start, NULL, threads[t]);
+            std::vector<client_worker> workers(threads[t]);
+            log_counters before, after;
+            GetLogCounters(&before);
+            for (int i = 0; i < threads[t]; i++) {
+                workers[i].level = level;
+                workers[i].calls = calls;
+                workers[i].start = &start;
+                pthread_create(&workers[i].thread, NULL, client_worker_main, &workers[i]);
+            }
+            std::vector<uint32_t> all;
+            all.reserve((size_t)calls * threads[t]);
+            uint64_t begin = UINT64_MAX, end = 0;
+            for (int i = 0; i < threads[t]; i++) {
+                pthread_join(workers[i].thread, NULL);
+                all.insert(all.end(), workers[i].lat.begin(), workers[i].lat.end());
+                begin = std::min(begin, workers[i].begin_ns);
+                end = std::max(end, workers[i].end_ns);
+            }
+            pthread_barrier_destroy(&start);
+            GetLogCounters(&after);
+            std::sort(all.begin(), all.end());
+
+            double secs = (end - begin) / 1e9;
+            unsigned long long dropped = (after.eagain - before.eagain) + (after.enobufs - before.enobufs) +
+                                         (after.errors - before.errors) + (after.ring_full - before.ring_full) +
+                                         (after.overwritten - before.overwritten) +
+                                         (after.sampled - before.sampled) + (after.timeouts - before.timeouts);
+            printf("{\"bench\":\"client\",\"mode\":\"%s\",\"format\":\"%s\",\"compress\":%d,\"threads\":%d,"
+                   "\"level\":\"%s\",\"filtered\":%s,\"calls\":%zu,\"seconds\":%.6f,\"calls_per_sec\":%.0f,"
+                   "\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"max_ns\":%u,\"dropped\":%llu}\n",
+                   async ? "async" : "sync", binary ? "binary" : "text", compress, threads[t], level_names[level],
+                   level < WARNING ? "true" : "false", all.size(), secs, secs > 0 ? all.size() / secs : 0.0,
+                   percentile(all, 0.5), percentile(all, 0.99), percentile(all, 0.999), all.empty() ? 0 : all.back(),
+                   dropped);
+            fflush(stdout);
+        }
+    }
+
+    ExitLog();
+    if (have_server) {
+        server_stop(&srv);
+        server_cleanup(&srv);
+    }
+    return 0;
+}
+
+// Server ingest benchmark -----------------------------------------------
+
+struct flood_worker {
+    pthread_t thread;
+    int id;
+    int lines;                // Text lines per datagram
+    double rate;              // Datagrams per second of this thread (0 = unlimited)
+    uint64_t until_ns;
+    uint64_t datagrams, records, failed;
+};
+
+static void *flood_worker_main(void *arg) {
+    struct flood_worker *w = (struct flood_worker *)arg;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return NULL;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    inet_aton(SERVER_IP, &addr.sin_addr);
+
+    static const int line_cap = 96;
+    std::vector<char> data((size_t)FLOOD_BATCH * w->lines * line_cap);
+    struct iovec iov[FLOOD_BATCH];
+    struct mmsghdr msgs[FLOOD_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    uint64_t start = now_ns(), seq = 0;
+    while (now_ns() < w->until_ns) {
+        int n = FLOOD_BATCH;
+        if (w->rate > 0) {
+            // Pace to the requested rate, sending what is due
+            uint64_t due = (uint64_t)((now_ns() - start) / 1e9 * w->rate);
+            if (due <= w->datagrams) {
+                usleep(100);
+                continue;
+            }
+            if (due - w->datagrams < (uint64_t)n) n = due - w->datagrams;
+        }
+        for (int i = 0; i < n; i++) {
+            char *p = &data[(size_t)i * w->lines * line_cap];
+            int len = 0;
+            for (int l = 0; l < w->lines; l++) {
+                len += snprintf(p + len, line_cap, "Fri Jan  2 03:04:05.678901 2026 WARNING bench.cpp:flood:%d seq %llu\n",
+                                w->id, (unsigned long long)seq++);
+            }
+            iov[i].iov_base = p;
+            iov[i].iov_len = len;
+            msgs[i].msg_hdr.msg_name = &addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int sent = sendmmsg(fd, msgs, n, 0);
+        if (sent < 0) {
+            w->failed += n;  // Local socket buffer full; the server is behind
+            sent = 0;
+        } else {
+            w->failed += n - sent;
+        }
+        w->datagrams += sent;
+        w->records += (uint64_t)sent * w->lines;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void count_line(const char *line, void *arg) {
+    if (strstr(line, "bench.cpp:flood:")) (*(uint64_t *)arg)++;
+}
+
+static int bench_ingest(int threads, double seconds, double rate, int lines) {
+    struct bench_server srv;
+    if (server_start(&srv) < 0) return 1;
+    fprintf(stderr, "ingest: %d threads, %.1f s, %d lines per datagram\n", threads, seconds, lines);
+
+    std::vector<flood_worker> workers(threads);
+    uint64_t begin = now_ns();
+    for (int i = 0; i < threads; i++) {
+        workers[i] = flood_worker();
+        workers[i].id = i;
+        workers[i].lines = lines;
+        workers[i].rate = rate / threads;
+        workers[i].until_ns = begin + (uint64_t)(seconds * 1e9);
+        pthread_create(&workers[i].thread, NULL, flood_worker_main, &workers[i]);
+    }
+    uint64_t datagrams = 0, records = 0, failed = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        datagrams += workers[i].datagrams;
+        records += workers[i].records;
+        failed += workers[i].failed;
+    }
+    uint64_t send_end = now_ns();
+    uint64_t drained = server_settle(&srv);
+    server_stop(&srv);
+
+    uint64_t stored = 0;
+    server_lines(&srv, count_line, &stored);
+    server_cleanup(&srv);
+
+    double send_secs = (send_end - begin) / 1e9;
+    double ingest_secs = ((drained > send_end ? drained : send_end) - begin) / 1e9;
+    printf("{\"bench\":\"ingest\",\"threads\":%d,\"lines_per_datagram\":%d,\"target_rate\":%.0f,"
+           "\"datagrams\":%llu,\"records\":%llu,\"send_failed\":%llu,\"stored\":%llu,\"send_seconds\":%.6f,"
+           "\"send_rate\":%.0f,\"ingest_seconds\":%.6f,\"ingest_rate\":%.0f,\"loss_rate\":%.6f}\n",
+           threads, lines, rate, (unsigned long long)datagrams, (unsigned long long)records,
+           (unsigned long long)failed, (unsigned long long)stored, send_secs, records / send_secs, ingest_secs,
+           stored / ingest_secs, records ? 1.0 - (double)stored / records : 0.0);
+    fflush(stdout);
+    return 0;
+}
+
+// End-to-end loss test --------------------------------------------------
+
+struct loss_worker {
+    pthread_t thread;
+    long first, count;        // Record numbers this thread logs
+};
+
+static void *loss_worker_main(void *arg) {
+    struct loss_worker *w = (struct loss_worker *)arg;
+    for (long i = w->first; i < w->first + w->count; i++) LOG_WARNING("bench-loss %ld", i);
+    return NULL;
+}
+
+struct loss_tally {
+    std::vector<uint8_t> seen;
+    uint64_t stored, duplicates;
+};
+
+static void tally_line(const char *line, void *arg) {
+    struct loss_tally *t = (struct loss_tally *)arg;
+    const char *p = strstr(line, "bench-loss ");
+    if (!p) return;
+    long n = atol(p + 11);
+    if (n < 0 || (size_t)n >= t->seen.size()) return;
+    if (t->seen[n]) t->duplicates++;
+    else t->stored++;
+    t->seen[n] = 1;
+}
+
+static int bench_loss(int threads, long records, int async, int binary, int compress) {
+    struct bench_server srv;
+    if (server_start(&srv) < 0) return 1;
+    fprintf(stderr, "loss: %d threads, %ld records\n", threads, records);
+
+    if (async) SetLogMode(LOG_MODE_ASYNC);
+    if (binary) SetLogFormat(LOG_FORMAT_BINARY);
+    SetLogCompression(compress);
+    SetLogClientId("logbench", "bench");
+    if (InitializeLog() < 0) {
+        fprintf(stderr, "InitializeLog failed\n");
+        server_stop(&srv);
+        server_cleanup(&srv);
+        return 1;
+    }
+    SetLogLevel(DEBUG);
+
+    std::vector<loss_worker> workers(threads);
+    uint64_t begin = now_ns();
+    for (int i = 0; i < threads; i++) {
+        workers[i].first = records * i / threads;
+        workers[i].count = records * (i + 1) / threads - workers[i].first;
+        pthread_create(&workers[i].thread, NULL, loss_worker_main, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++) pthread_join(workers[i].thread, NULL);
+    double secs = (now_ns() - begin) / 1e9;
+    ExitLog();  // Flushes what is still queued
+    log_counters c;
+    GetLogCounters(&c);
+
+    server_settle(&srv);
+    server_stop(&srv);
+    struct loss_tally tally;
+    tally.seen.assign(records, 0);
+    tally.stored = tally.duplicates = 0;
+    server_lines(&srv, tally_line, &tally);
+    server_cleanup(&srv);
+
+    unsigned long long client_dropped = c.eagain + c.enobufs + c.errors + c.ring_full + c.overwritten + c.sampled +
+                                        c.timeouts;
+    long long in_transit = (long long)records - (long long)client_dropped - (long long)tally.stored;
+    printf("{\"bench\":\"loss\",\"mode\":\"%s\",\"format\":\"%s\",\"compress\":%d,\"threads\":%d,\"records\":%ld,"
+           "\"seconds\":%.6f,\"client_dropped\":%llu,\"stored\":%llu,\"duplicates\":%llu,\"lost_in_transit\":%lld,"
+           "\"loss_rate\":%.6f}\n",
+           async ? "async" : "sync", binary ? "binary" : "text", compress, threads, records, secs, client_dropped,
+           (unsigned long long)tally.stored, (unsigned long long)tally.duplicates, in_transit,
+           records ? 1.0 - (double)tally.stored / records : 0.0);
+    fflush(stdout);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s client [-t threads,...] [-n calls] [-a] [-f] [-c] [-s server] [-- server options]\n"
+            "       %s ingest [-t threads] [-d seconds] [-r datagrams/s] [-b lines] [-s server] [-- server options]\n"
+            "       %s loss [-t threads] [-n records] [-a] [-f] [-c] [-s server] [-- server options]\n",
+            prog, prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) usage(argv[0]);
+    const char *bench = argv[1];
+    int threads[16] = { 1, 2, 4, 8 };
+    int nthreads = -1;
+    long count = -1;
+    double seconds = 5, rate = 0;
+    int lines = 1, async = 0, binary = 0, compress = 0;
+
+    // getopt() stops at "--"; what follows goes to the server
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "t:n:d:r:b:afcs:")) != -1) {
+        if (opt == 't') {
+            nthreads = parse_threads(optarg, threads, 16);
+            if (nthreads < 1) usage(argv[0]);
+        } else if (opt == 'n' && atol(optarg) > 0) {
+            count = atol(optarg);
+        } else if (opt == 'd' && atof(optarg) > 0) {
+            seconds = atof(optarg);
+        } else if (opt == 'r' && atof(optarg) >= 0) {
+            rate = atof(optarg);
+        } else if (opt == 'b' && atoi(optarg) > 0 && atoi(optarg) <= 64) {
+            lines = atoi(optarg);
+        } else if (opt == 'a') {
+            async = 1;
+        } else if (opt == 'f') {
+            binary = 1;
+        } else if (opt == 'c') {
+            compress = 1;
+        } else if (opt == 's') {
+            server_bin = optarg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    server_args = argv + optind;
+    server_nargs = argc - optind;
+    signal(SIGPIPE, SIG_IGN);
+
+    if (strcmp(bench, "client") == 0) {
+        return bench_client(nthreads > 0 ? nthreads : 4, threads, count > 0 ? count : 20000, async, binary,
+                            compress);
+    } else if (strcmp(bench, "ingest") == 0) {
+        return bench_ingest(nthreads > 0 ? threads[0] : 4, seconds, rate, lines);
+    } else if (strcmp(bench, "loss") == 0) {
+        return bench_loss(nthreads > 0 ? threads[0] : 4, count > 0 ? count : 200000, async, binary, compress);
+    }
+    usage(argv[0]);
+    return 1;
+}
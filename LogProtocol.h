@@ -0,0 +1,917 @@
+#ifndef LOG_PROTOCOL_H
+#define LOG_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Binary records shared by Logger and LogServer.
+//
+// A binary datagram holds one or more records back to back. Every record
+// starts with LOG_WIRE_MAGIC, which is not a printable character, so the
+// server can tell binary datagrams from text ones by their first byte.
+// Multi-byte fields are little-endian.
+//
+// All records share a 4-byte prefix: magic (u8), version (u8), type (u8)
+// and level (u8, a LOG_LEVEL). The rest depends on the type:
+//
+// LOG_WIRE_INLINE (LOG_WIRE_HEADER_LEN bytes of header):
+//   4  timestamp    u64  nanoseconds since the epoch (CLOCK_REALTIME)
+//   12 line         u32
+//   16 file_len     u16
+//   18 func_len     u16
+//   20 msg_len      u16
+// followed by file_len + func_len + msg_len bytes of text, not terminated.
+//
+// LOG_WIRE_SITE announces a call site once (LOG_WIRE_SITE_LEN bytes of header):
+//   4  site_id      u32  chosen by the client, unique per client
+//   8  line         u32
+//   12 file_len     u16
+//   14 func_len     u16
+// followed by file_len + func_len bytes of text.
+//
+// LOG_WIRE_REF is a record from an announced site (LOG_WIRE_REF_LEN bytes of header):
+//   4  timestamp    u64
+//   12 site_id      u32
+//   16 msg_len      u16
+// followed by msg_len bytes of text.
+//
+// LOG_WIRE_FMT_SITE announces a call site that logs through a format
+// string (LOG_WIRE_FMT_SITE_LEN bytes of header):
+//   4  site_id      u32
+//   8  line         u32
+//   12 file_len     u16
+//   14 func_len     u16
+//   16 fmt_len      u16
+// followed by file_len + func_len + fmt_len bytes of text.
+//
+// LOG_WIRE_ARGS is a record from an announced format site, carrying the
+// raw arguments for the server to format (LOG_WIRE_ARGS_LEN bytes of header):
+//   4  timestamp    u64
+//   12 site_id      u32
+//   16 args_len     u16
+// followed by args_len bytes of arguments, each a LOG_ARG_TYPE byte and
+// then an 8-byte value, or for LOG_ARG_STRING a u16 length and the bytes.
+//
+// LOG_WIRE_SEQ numbers the records of a datagram (LOG_WIRE_SEQ_LEN bytes,
+// level unused). It comes first and is followed by either binary records
+// or text lines, in both wire formats:
+//   4  seq          u64  sequence number of the first record, per client
+//   12 count        u32  records in the datagram, announcements not counted
+// The next datagram of the client starts at seq + count, so the server
+// can count the records lost in between.
+//
+// LOG_WIRE_LZ carries the rest of the datagram compressed with the LZ
+// codec below (LOG_WIRE_LZ_LEN bytes of header, level unused). It follows
+// the sequence header, so loss accounting works without decompressing:
+//   4  raw_len      u32  size of the payload once decompressed
+//   8  packed_len   u32  compressed bytes following the header
+
+#define LOG_WIRE_MAGIC 0xB7
+#define LOG_WIRE_VERSION 1
+#define LOG_WIRE_HEADER_LEN 22
+#define LOG_WIRE_SITE_LEN 16
+#define LOG_WIRE_REF_LEN 18
+#define LOG_WIRE_FMT_SITE_LEN 18
+#define LOG_WIRE_ARGS_LEN 18
+#define LOG_WIRE_SEQ_LEN 16
+#define LOG_WIRE_LZ_LEN 12
+#define LOG_MAX_ARGS 16       // Most arguments one formatted record may carry
+
+// Record types
+enum LOG_WIRE_TYPE {
+    LOG_WIRE_INLINE = 1,  // Call-site strings carried in the record
+    LOG_WIRE_SITE = 2,    // Call-site announcement, no message
+    LOG_WIRE_REF = 3,     // Message from a previously announced call site
+    LOG_WIRE_FMT_SITE = 4, // Announcement of a call site with a format string
+    LOG_WIRE_ARGS = 5,    // Raw arguments for a previously announced format site
+    LOG_WIRE_SEQ = 6,     // Sequence number of the datagram's records
+    LOG_WIRE_LZ = 7       // Compressed remainder of the datagram
+};
+
+// Types of captured format arguments
+enum LOG_ARG_TYPE {
+    LOG_ARG_INT = 1,      // Signed integer, widened to 64 bits
+    LOG_ARG_UINT = 2,     // Unsigned integer, widened to 64 bits
+    LOG_ARG_DOUBLE = 3,   // Floating point, widened to double
+    LOG_ARG_STRING = 4,   // Character string, not necessarily terminated
+    LOG_ARG_PTR = 5       // Pointer value
+};
+
+// One captured format argument
+struct log_arg {
+    uint8_t type;         // LOG_ARG_TYPE
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const char *s;
+    };
+    uint32_t len;         // Length of s for LOG_ARG_STRING
+};
+
+// A decoded record. The strings point into the datagram; fields a type
+// does not carry are zero.
+struct log_wire_record {
+    uint8_t type;
+    uint8_t level;
+    uint64_t timestamp_ns;
+    uint32_t site_id;
+    uint32_t line;
+    const char *file;
+    uint16_t file_len;
+    const char *func;
+    uint16_t func_len;
+    const char *msg;
+    uint16_t msg_len;
+    const char *fmt;      // LOG_WIRE_FMT_SITE only
+    uint16_t fmt_len;
+    const uint8_t *args;  // LOG_WIRE_ARGS only, see log_wire_decode_args()
+    uint16_t args_len;
+    uint64_t seq;         // LOG_WIRE_SEQ only
+    uint32_t count;       // LOG_WIRE_SEQ only
+    const uint8_t *packed; // LOG_WIRE_LZ only, see log_lz_decompress()
+    uint32_t packed_len;
+    uint32_t raw_len;
+};
+
+static inline void log_wire_put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void log_wire_put32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+
+static inline void log_wire_put64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = v >> (8 * i);
+}
+
+static inline uint16_t log_wire_get16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t log_wire_get32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static inline uint64_t log_wire_get64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+/**
+ * Encodes an inline record into buf. The message is truncated to fit.
+ *
+ * @return Number of bytes written, or -1 if not even the header and
+ *         call-site strings fit
+ */
+static inline int log_wire_encode(uint8_t *buf, int cap, uint8_t level, uint64_t timestamp_ns,
+                                  const char *file, const char *func, uint32_t line, const char *msg) {
+    size_t file_len = strlen(file);
+    size_t func_len = strlen(func);
+    size_t msg_len = strlen(msg);
+    if (file_len > 0xFFFF) file_len = 0xFFFF;
+    if (func_len > 0xFFFF) func_len = 0xFFFF;
+    long room = (long)cap - LOG_WIRE_HEADER_LEN - (long)file_len - (long)func_len;
+    if (room < 0) return -1;
+    if ((long)msg_len > room) msg_len = room;
+    if (msg_len > 0xFFFF) msg_len = 0xFFFF;
+
+    buf[0] = LOG_WIRE_MAGIC;
+    buf[1] = LOG_WIRE_VERSION;
+    buf[2] = LOG_WIRE_INLINE;
+    buf[3] = level;
+    log_wire_put64(buf + 4, timestamp_ns);
+    log_wire_put32(buf + 12, line);
+    log_wire_put16(buf + 16, file_len);
+    log_wire_put16(buf + 18, func_len);
+    log_wire_put16(buf + 20, msg_len);
+    uint8_t *p = buf + LOG_WIRE_HEADER_LEN;
+    memcpy(p, file, file_len);
+    p += file_len;
+    memcpy(p, func, func_len);
+    p += func_len;
+    memcpy(p, msg, msg_len);
+    p += msg_len;
+    return p - buf;
+}
+
+/**
+ * Encodes a call-site announcement into buf.
+ *
+ * @return Number of bytes written, or -1 if it does not fit
+ */
+static inline int log_wire_encode_site(uint8_t *buf, int cap, uint8_t level, uint32_t site_id,
+                                       const char *file, const char *func, uint32_t line) {
+    size_t file_len = strlen(file);
+    size_t func_len = strlen(func);
+    if (file_len > 0xFFFF || func_len > 0xFFFF) return -1;
+    if ((long)cap < (long)(LOG_WIRE_SITE_LEN + file_len + func_len)) return -1;
+
+    buf[0] = LOG_WIRE_MAGIC;
+    buf[1] = LOG_WIRE_VERSION;
+    buf[2] = LOG_WIRE_SITE;
+    buf[3] = level;
+    log_wire_put32(buf + 4, site_id);
+    log_wire_put32(buf + 8, line);
+    log_wire_put16(buf + 12, file_len);
+    log_wire_put16(buf + 14, func_len);
+    memcpy(buf + LOG_WIRE_SITE_LEN, file, file_len);
+    memcpy(buf + LOG_WIRE_SITE_LEN + file_len, func, func_len);
+    return LOG_WIRE_SITE_LEN + file_len + func_len;
+}
+
+/**
+ * Encodes a record from an announced call site into buf. The message is
+ * truncated to fit.
+ *
+ * @return Number of bytes written, or -1 if not even the header fits
+ */
+static inline int log_wire_encode_ref(uint8_t *buf, int cap, uint8_t level, uint64_t timestamp_ns,
+                                      uint32_t site_id, const char *msg) {
+    if (cap < LOG_WIRE_REF_LEN) return -1;
+    size_t msg_len = strlen(msg);
+    if (msg_len > (size_t)(cap - LOG_WIRE_REF_LEN)) msg_len = cap - LOG_WIRE_REF_LEN;
+    if (msg_len > 0xFFFF) msg_len = 0xFFFF;
+
+    buf[0] = LOG_WIRE_MAGIC;
+    buf[1] = LOG_WIRE_VERSION;
+    buf[2] = LOG_WIRE_REF;
+    buf[3] = level;
+    log_wire_put64(buf + 4, timestamp_ns);
+    log_wire_put32(buf + 12, site_id);
+    log_wire_put16(buf + 16, msg_len);
+    memcpy(buf + LOG_WIRE_REF_LEN, msg, msg_len);
+    return LOG_WIRE_REF_LEN + msg_len;
+}
+
+/**
+ * Encodes the announcement of a format call site into buf.
+ *
+ * @return Number of bytes written, or -1 if it does not fit
+ */
+static inline int log_wire_encode_fmt_site(uint8_t *buf, int cap, uint8_t level, uint32_t site_id,
+                                           const char *file, const char *func, uint32_t line, const char *fmt) {
+    size_t file_len = strlen(file);
+    size_t func_len = strlen(func);
+    size_t fmt_len = strlen(fmt);
+    if (file_len > 0xFFFF || func_len > 0xFFFF || fmt_len > 0xFFFF) return -1;
+    if ((long)cap < (long)(LOG_WIRE_FMT_SITE_LEN + file_len + func_len + fmt_len)) return -1;
+
+    buf[0] = LOG_WIRE_MAGIC;
+    buf[1] = LOG_WIRE_VERSION;
+    buf[2] = LOG_WIRE_FMT_SITE;
+    buf[3] = level;
+    log_wire_put32(buf + 4, site_id);
+    log_wire_put32(buf + 8, line);
+    log_wire_put16(buf + 12, file_len);
+    log_wire_put16(buf + 14, func_len);
+    log_wire_put16(buf + 16, fmt_len);
+    uint8_t *p = buf + LOG_WIRE_FMT_SITE_LEN;
+    memcpy(p, file, file_len);
+    p += file_len;
+    memcpy(p, func, func_len);
+    p += func_len;
+    memcpy(p, fmt, fmt_len);
+    p += fmt_len;
+    return p - buf;
+}
+
+/**
+ * Encodes the raw arguments of a record from a format call site into buf.
+ * Strings are truncated and trailing arguments dropped to fit.
+ *
+ * @return Number of bytes written, or -1 if not even the header fits
+ */
+static inline int log_wire_encode_args(uint8_t *buf, int cap, uint8_t level, uint64_t timestamp_ns,
+                                       uint32_t site_id, const struct log_arg *args, int nargs) {
+    if (cap < LOG_WIRE_ARGS_LEN) return -1;
+    uint8_t *p = buf + LOG_WIRE_ARGS_LEN;
+    uint8_t *end = buf + (cap - LOG_WIRE_ARGS_LEN > 0xFFFF ? LOG_WIRE_ARGS_LEN + 0xFFFF : cap);
+    for (int i = 0; i < nargs; i++) {
+        if (args[i].type == LOG_ARG_STRING) {
+            if (end - p < 3) break;
+            size_t len = args[i].len;
+            if (len > (size_t)(end - p - 3)) len = end - p - 3;
+            *p = LOG_ARG_STRING;
+            log_wire_put16(p + 1, len);
+            memcpy(p + 3, args[i].s, len);
+            p += 3 + len;
+        } else {
+            if (end - p < 9) break;
+            *p = args[i].type;
+            log_wire_put64(p + 1, args[i].u);
+            p += 9;
+        }
+    }
+
+    buf[0] = LOG_WIRE_MAGIC;
+    buf[1] = LOG_WIRE_VERSION;
+    buf[2] = LOG_WIRE_ARGS;
+    buf[3] = level;
+    log_wire_put64(buf + 4, timestamp_ns);
+    log_wire_put32(buf + 12, site_id);
+    log_wire_put16(buf + 16, p - buf - LOG_WIRE_ARGS_LEN);
+    return p - buf;
+}
+
+/**
+ * Decodes the argument bytes of a LOG_WIRE_ARGS record. Strings point
+ * into the record.
+ *
+ * @return Number of arguments decoded, at most max
+ */
+static inline int log_wire_decode_args(const uint8_t *p, size_t len, struct log_arg *args, int max) {
+    const uint8_t *end = p + len;
+    int n = 0;
+    while (n < max && p < end) {
+        struct log_arg *arg = &args[n];
+        arg->type = *p;
+        arg->len = 0;
+        if (arg->type == LOG_ARG_STRING) {
+            if (end - p < 3) break;
+            arg->len = log_wire_get16(p + 1);
+            if ((size_t)(end - p - 3) < arg->len) break;
+            arg->s = (const char *)p + 3;
+            p += 3 + arg->len;
+        } else if (arg->type >= LOG_ARG_INT && arg->type <= LOG_ARG_PTR) {
+            if (end - p < 9) break;
+            arg->u = log_wire_get64(p + 1);
+            p += 9;
+        } else {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Formats a printf-style format string with captured arguments. Length
+ * modifiers in the format are ignored since every argument carries its own
+ * width; '*' widths and precisions consume an argument as printf does.
+ * Conversions without a matching argument are copied as-is.
+ *
+ * @param out Output buffer, always terminated when cap > 0.
+ * @param cap Size of out.
+ * @param fmt Format string, fmt_len bytes long.
+ * @return Number of characters written, excluding the terminator.
+ */
+static inline int log_format_args(char *out, size_t cap, const char *fmt, size_t fmt_len,
+                                  const struct log_arg *args, int nargs) {
+    if (cap == 0) return 0;
+    size_t pos = 0;
+    int next = 0;
+    const char *p = fmt, *end = fmt + fmt_len;
+    while (p < end && pos + 1 < cap) {
+        if (*p != '%') {
+            out[pos++] = *p++;
+            continue;
+        }
+        const char *start = p++;
+        if (p < end && *p == '%') {
+            out[pos++] = '%';
+            p++;
+            continue;
+        }
+
+        // Rebuild the conversion as "%<flags><width><.precision>" + conversion
+        char spec[64];
+        int sl = 0;
+        spec[sl++] = '%';
+        while (p < end && strchr("-+ #0", *p) && sl < 8) spec[sl++] = *p++;
+        for (int part = 0; part < 2; part++) {
+            if (part == 1) {
+                if (p >= end || *p != '.') break;
+                spec[sl++] = *p++;
+            }
+            if (p < end && *p == '*') {
+                p++;
+                long v = next < nargs && args[next].type != LOG_ARG_STRING ? (long)args[next].i : 0;
+                next++;
+                sl += snprintf(spec + sl, sizeof(spec) - sl - 8, "%ld", v);
+            } else {
+                while (p < end && *p >= '0' && *p <= '9' && sl < 40) spec[sl++] = *p++;
+            }
+        }
+        while (p < end && strchr("hlLqjzt", *p)) p++;
+        spec[sl] = '\0';
+        if (p >= end) {
+            p = start;  // Dangling '%', copy it literally
+            out[pos++] = *p++;
+            continue;
+        }
+        char conv = *p++;
+
+        size_t room = cap - pos;
+        int n = -1;
+        const struct log_arg *arg = next < nargs ? &args[next] : NULL;
+        if (arg && strchr("diouxXcspeEfFgGaA", conv)) {
+            next++;
+            // Pick the conversion the argument can actually satisfy
+            char kind = conv;
+            if (arg->type == LOG_ARG_STRING) kind = 's';
+            else if (conv == 's') kind = arg->type == LOG_ARG_DOUBLE ? 'g' : arg->type == LOG_ARG_PTR ? 'p' : arg->type == LOG_ARG_INT ? 'd' : 'u';
+            else if (arg->type == LOG_ARG_DOUBLE && !strchr("eEfFgGaA", conv)) kind = 'g';
+            else if (arg->type != LOG_ARG_DOUBLE && strchr("eEfFgGaA", conv)) kind = arg->type == LOG_ARG_INT ? 'd' : 'u';
+
+            if (kind == 's') {
+                // Strings need not be terminated, so always bound them by length
+                char *dot = (char *)memchr(spec, '.', sl);
+                long prec = arg->len;
+                if (dot) {
+                    prec = atol(dot + 1);
+                    if (prec > (long)arg->len) prec = arg->len;
+                    sl = dot - spec;
+                }
+                memcpy(spec + sl, ".*s", 4);
+                n = snprintf(out + pos, room, spec, (int)prec, arg->s);
+            } else if (kind == 'c') {
+                memcpy(spec + sl, "c", 2);
+                n = snprintf(out + pos, room, spec, (int)arg->i);
+            } else if (kind == 'p') {
+                memcpy(spec + sl, "p", 2);
+                n = snprintf(out + pos, room, spec, (void *)(uintptr_t)arg->u);
+            } else if (strchr("eEfFgGaA", kind)) {
+                spec[sl] = kind;
+                spec[sl + 1] = '\0';
+                n = snprintf(out + pos, room, spec, arg->d);
+            } else {
+                spec[sl] = 'l';
+                spec[sl + 1] = 'l';
+                spec[sl + 2] = kind;
+                spec[sl + 3] = '\0';
+                if (kind == 'd' || kind == 'i') {
+                    n = snprintf(out + pos, room, spec, (long long)arg->i);
+                } else {
+                    n = snprintf(out + pos, room, spec, (unsigned long long)arg->u);
+                }
+            }
+        }
+        if (n < 0) {
+            // Unknown conversion or missing argument, copy it literally
+            n = p - start;
+            if ((size_t)n >= room) n = room - 1;
+            memcpy(out + pos, start, n);
+        }
+        pos += (size_t)n < room ? (size_t)n : room - 1;
+    }
+    out[pos] = '\0';
+    return pos;
+}
+
+/**
+ * Encodes the sequence header of a datagram into buf, which must hold
+ * LOG_WIRE_SEQ_LEN bytes.
+ */
+static inline void log_wire_encode_seq(uint8_t *buf, uint64_t seq, uint32_t count) {
+    buf[0] = LOG_WIRE_MAGIC;
+    buf[1] = LOG_WIRE_VERSION;
+    buf[2] = LOG_WIRE_SEQ;
+    buf[3] = 0;
+    log_wire_put64(buf + 4, seq);
+    log_wire_put32(buf + 12, count);
+}
+
+/**
+ * Decodes the record at the start of buf.
+ *
+ * @return Length of the record, or -1 if buf does not hold a complete,
+ *         well-formed record
+ */
+static inline int log_wire_decode(const uint8_t *buf, size_t len, struct log_wire_record *rec) {
+    if (len < 4 || buf[0] != LOG_WIRE_MAGIC || buf[1] != LOG_WIRE_VERSION) return -1;
+    memset(rec, 0, sizeof(*rec));
+    rec->type = buf[2];
+    rec->level = buf[3];
+
+    size_t header;
+    if (rec->type == LOG_WIRE_INLINE) {
+        header = LOG_WIRE_HEADER_LEN;
+        if (len < header) return -1;
+        rec->timestamp_ns = log_wire_get64(buf + 4);
+        rec->line = log_wire_get32(buf + 12);
+        rec->file_len = log_wire_get16(buf + 16);
+        rec->func_len = log_wire_get16(buf + 18);
+        rec->msg_len = log_wire_get16(buf + 20);
+    } else if (rec->type == LOG_WIRE_SITE) {
+        header = LOG_WIRE_SITE_LEN;
+        if (len < header) return -1;
+        rec->site_id = log_wire_get32(buf + 4);
+        rec->line = log_wire_get32(buf + 8);
+        rec->file_len = log_wire_get16(buf + 12);
+        rec->func_len = log_wire_get16(buf + 14);
+    } else if (rec->type == LOG_WIRE_REF) {
+        header = LOG_WIRE_REF_LEN;
+        if (len < header) return -1;
+        rec->timestamp_ns = log_wire_get64(buf + 4);
+        rec->site_id = log_wire_get32(buf + 12);
+        rec->msg_len = log_wire_get16(buf + 16);
+    } else if (rec->type == LOG_WIRE_FMT_SITE) {
+        header = LOG_WIRE_FMT_SITE_LEN;
+        if (len < header) return -1;
+        rec->site_id = log_wire_get32(buf + 4);
+        rec->line = log_wire_get32(buf + 8);
+        rec->file_len = log_wire_get16(buf + 12);
+        rec->func_len = log_wire_get16(buf + 14);
+        rec->fmt_len = log_wire_get16(buf + 16);
+    } else if (rec->type == LOG_WIRE_ARGS) {
+        header = LOG_WIRE_ARGS_LEN;
+        if (len < header) return -1;
+        rec->timestamp_ns = log_wire_get64(buf + 4);
+        rec->site_id = log_wire_get32(buf + 12);
+        rec->args_len = log_wire_get16(buf + 16);
+    } else if (rec->type == LOG_WIRE_SEQ) {
+        header = LOG_WIRE_SEQ_LEN;
+        if (len < header) return -1;
+        rec->seq = log_wire_get64(buf + 4);
+        rec->count = log_wire_get32(buf + 12);
+    } else if (rec->type == LOG_WIRE_LZ) {
+        header = LOG_WIRE_LZ_LEN;
+        if (len < header) return -1;
+        rec->raw_len = log_wire_get32(buf + 4);
+        rec->packed_len = log_wire_get32(buf + 8);
+        if (rec->packed_len > len - header) return -1;
+        rec->packed = buf + header;
+        return header + rec->packed_len;
+    } else {
+        return -1;
+    }
+
+    // Variable parts follow the header in this order; absent ones are empty
+    size_t total = header + (size_t)rec->file_len + rec->func_len + rec->msg_len + rec->fmt_len + rec->args_len;
+    if (total > len) return -1;
+    rec->file = (const char *)buf + header;
+    rec->func = rec->file + rec->file_len;
+    rec->msg = rec->func + rec->func_len;
+    rec->fmt = rec->msg + rec->msg_len;
+    rec->args = (const uint8_t *)rec->fmt + rec->fmt_len;
+    return total;
+}
+
+// LZ codec for LOG_WIRE_LZ datagrams and compressed log segments.
+//
+// A block is a series of sequences. Each starts with a token byte whose
+// high nibble is the literal count and low nibble the match length minus
+// LOG_LZ_MIN_MATCH; a nibble of 15 is continued by bytes added to it
+// until one is below 255. The literals follow, then a u16 offset back
+// into the output and any match length continuation. The last sequence
+// ends after its literals. Offsets may reach back past the start of the
+// output into log_lz_dict, a preset dictionary of the text every log
+// record repeats, so even a single short record compresses.
+#define LOG_LZ_HASH_BITS 12
+#define LOG_LZ_MIN_MATCH 4
+#define LOG_LZ_MAX_OFFSET 65535
+#define LOG_LZ_BOUND(n) ((n) + (n) / 255 + 16)  // Worst-case compressed size
+
+// Changing the dictionary changes the format; bump LOG_WIRE_VERSION with it
+static const char log_lz_dict[] =
+    "Client Hello from send_socket id= group=default "
+    "log records dropped (socket full , ring full , overwritten , sampled , timed out ) "
+    "Mon Jan Tue Feb Wed Mar Thu Apr Fri May Sat Jun Sun Jul Aug Sep Oct Nov Dec "
+    " DEBUG  WARNING  ERROR  CRITICAL "
+    ".cpp:main: .cpp: .c: .h: operator(): "
+    "[127.0.0.1:] [unix:] [shm:] "
+    "failed error retry timeout connect socket buffer message value count thread";
+#define LOG_LZ_DICT_LEN ((uint32_t)sizeof(log_lz_dict) - 1)
+
+static inline uint32_t log_lz_hash(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LOG_LZ_HASH_BITS);
+}
+
+// Positions of the dictionary's 4-byte sequences, by hash (0 = none, else pos + 1)
+struct log_lz_dict_index {
+    uint32_t pos[1 << LOG_LZ_HASH_BITS];
+    log_lz_dict_index() {
+        memset(pos, 0, sizeof(pos));
+        for (uint32_t i = 0; i + LOG_LZ_MIN_MATCH <= LOG_LZ_DICT_LEN; i++) {
+            pos[log_lz_hash((const uint8_t *)log_lz_dict + i)] = i + 1;
+        }
+    }
+};
+
+// Match finder state of one compressing thread. Entries are valid when
+// their stamp equals gen, so nothing is cleared between blocks.
+struct log_lz_ctx {
+    uint32_t gen;
+    uint32_t pos[1 << LOG_LZ_HASH_BITS];    // Input position of a sequence, by hash
+    uint32_t stamp[1 << LOG_LZ_HASH_BITS];  // gen of the block that set pos
+};
+
+static inline uint8_t *log_lz_put_len(uint8_t *op, size_t n) {
+    for (; n >= 255; n -= 255) *op++ = 255;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+/**
+ * Compresses src into dst.
+ *
+ * @param ctx Match finder state, zero-initialized before first use
+ * @param cap Size of dst; LOG_LZ_BOUND(len) always suffices
+ * @return Compressed size, or -1 if it would exceed cap
+ */
+static inline int log_lz_compress(struct log_lz_ctx *ctx, const uint8_t *src, uint32_t len, uint8_t *dst,
+                                  uint32_t cap) {
+    static const log_lz_dict_index dict;  // Built once, shared by all threads
+    const uint8_t *dsrc = (const uint8_t *)log_lz_dict;
+    const uint32_t D = LOG_LZ_DICT_LEN;
+    if (++ctx->gen == 0) {
+        memset(ctx->stamp, 0, sizeof(ctx->stamp));
+        ctx->gen = 1;
+    }
+
+    uint8_t *op = dst, *oend = dst + cap;
+    uint32_t anchor = 0, i = 0;
+    while (i + LOG_LZ_MIN_MATCH <= len) {
+        uint32_t h = log_lz_hash(src + i);
+        uint32_t ml = 0, off = 0;
+        if (ctx->stamp[h] == ctx->gen) {
+            uint32_t s = ctx->pos[h];
+            if (i - s <= LOG_LZ_MAX_OFFSET) {
+                while (i + ml < len && src[s + ml] == src[i + ml]) ml++;
+                off = i - s;
+            }
+        } else if (dict.pos[h] && D - (dict.pos[h] - 1) + i <= LOG_LZ_MAX_OFFSET) {
+            uint32_t s = dict.pos[h] - 1;  // Matches stop at the end of the dictionary
+            while (s + ml < D && i + ml < len && dsrc[s + ml] == src[i + ml]) ml++;
+            off = D - s + i;
+        }
+        ctx->stamp[h] = ctx->gen;
+        ctx->pos[h] = i;
+        if (ml < LOG_LZ_MIN_MATCH) {
+            i += 1 + ((i - anchor) >> 6);  // Step faster through incompressible data
+            continue;
+        }
+
+        uint32_t lit = i - anchor, mlc = ml - LOG_LZ_MIN_MATCH;
+        if (op + 1 + lit + lit / 255 + 1 + 2 + mlc / 255 + 1 > oend) return -1;
+        *op++ = (uint8_t)(((lit < 15 ? lit : 15) << 4) | (mlc < 15 ? mlc : 15));
+        if (lit >= 15) op = log_lz_put_len(op, lit - 15);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        log_wire_put16(op, (uint16_t)off);
+        op += 2;
+        if (mlc >= 15) op = log_lz_put_len(op, mlc - 15);
+        i += ml;
+        anchor = i;
+    }
+
+    uint32_t lit = len - anchor;
+    if (op + 1 + lit + lit / 255 + 1 > oend) return -1;
+    *op++ = (uint8_t)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op = log_lz_put_len(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+static inline int log_lz_get_len(const uint8_t **ip, const uint8_t *iend, uint32_t *n) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+/**
+ * Decompresses a block produced by log_lz_compress(). Safe on malformed
+ * input.
+ *
+ * @param cap Size of dst, at least the expected output size
+ * @return Decompressed size, or -1 if src is malformed or does not fit
+ */
+static inline int log_lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap) {
+    const uint8_t *ip = src, *iend = src + len;
+    const uint8_t *dsrc = (const uint8_t *)log_lz_dict;
+    uint32_t op = 0;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        uint32_t lit = token >> 4;
+        if (lit == 15 && log_lz_get_len(&ip, iend, &lit) < 0) return -1;
+        if (lit > (uint32_t)(iend - ip) || lit > cap - op) return -1;
+        memcpy(dst + op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) break;  // Last sequence
+
+        if (iend - ip < 2) return -1;
+        uint32_t off = log_wire_get16(ip);
+        ip += 2;
+        uint32_t ml = token & 15;
+        if (ml == 15 && log_lz_get_len(&ip, iend, &ml) < 0) return -1;
+        ml += LOG_LZ_MIN_MATCH;
+        if (off == 0 || off > op + LOG_LZ_DICT_LEN || ml > cap - op) return -1;
+        if (off <= op && off >= ml) {
+            memcpy(dst + op, dst + op - off, ml);
+            op += ml;
+            continue;
+        }
+        for (uint32_t k = 0; k < ml; k++, op++) {
+            dst[op] = off <= op ? dst[op - off] : dsrc[LOG_LZ_DICT_LEN - (off - op)];
+        }
+    }
+    return op;
+}
+
+/**
+ * Compresses a datagram payload into a LOG_WIRE_LZ record in dst.
+ *
+ * @param cap Size of dst
+ * @return Length of the record, or -1 when compressing does not make the
+ *         payload smaller
+ */
+static inline int log_wire_encode_lz(struct log_lz_ctx *ctx, const uint8_t *src, uint32_t len, uint8_t *dst,
+                                     uint32_t cap) {
+    if (cap <= LOG_WIRE_LZ_LEN || len <= LOG_WIRE_LZ_LEN) return -1;
+    uint32_t room = cap - LOG_WIRE_LZ_LEN;
+    if (room > len - LOG_WIRE_LZ_LEN) room = len - LOG_WIRE_LZ_LEN;  // Must come out smaller
+    int n = log_lz_compress(ctx, src, len, dst + LOG_WIRE_LZ_LEN, room);
+    if (n < 0) return -1;
+    dst[0] = LOG_WIRE_MAGIC;
+    dst[1] = LOG_WIRE_VERSION;
+    dst[2] = LOG_WIRE_LZ;
+    dst[3] = 0;
+    log_wire_put32(dst + 4, len);
+    log_wire_put32(dst + 8, n);
+    return LOG_WIRE_LZ_LEN + n;
+}
+
+// Crash ring: a shared-memory segment (shm_open()) every client record is
+// also written to as a text line, so the last records survive a crash of
+// the client. A clean ExitLog() removes the segment; after a crash
+// LogRecover extracts the records from it.
+//
+// The segment is a log_crash_header followed by `slots` slots of
+// `slot_size` bytes, each a log_crash_slot and its text. Writers claim
+// record numbers from `next` and use slot (number % slots). A slot's seq
+// is 2 * number + 1 while it is being written and 2 * number + 2 once
+// complete, so readers skip slots a writer was in the middle of. A writer
+// only takes a slot whose seq is complete and older than its own number,
+// and readers skip slots whose number does not belong there.
+#define LOG_CRASH_MAGIC 0x4C4F4743u   // "LOGC"
+#define LOG_CRASH_VERSION 1
+
+struct log_crash_header {
+    uint32_t magic;       // LOG_CRASH_MAGIC
+    uint32_t version;     // LOG_CRASH_VERSION
+    uint32_t slots;       // Number of slots, a power of two
+    uint32_t slot_size;   // Bytes per slot, log_crash_slot included
+    uint64_t next;        // Number of the next record, updated atomically
+    int32_t pid;          // Process that owns the segment
+    char client_id[64];   // Its SetLogClientId() name
+};
+
+struct log_crash_slot {
+    uint64_t seq;         // 2 * number + 1 while written, 2 * number + 2 when complete
+    uint32_t len;         // Bytes of text following the slot header
+    uint32_t reserved;
+};
+
+// Returns slot i of a crash ring segment
+static inline struct log_crash_slot *log_crash_slot_at(struct log_crash_header *hdr, uint32_t i) {
+    return (struct log_crash_slot *)((char *)hdr + sizeof(*hdr) + (size_t)i * hdr->slot_size);
+}
+
+// Local transports for clients on the server's host, see SetLogTransport().
+// Both carry the same datagrams as UDP (sequence header, then records);
+// level commands always travel over UDP.
+//
+// LOG_LOCAL_SOCKET is the abstract Unix datagram socket LogServer binds.
+//
+// LOG_SHM_NAME is a shared-memory ring LogServer creates at start-up: a
+// log_shm_header followed by `slots` slots of sizeof(log_shm_slot) +
+// `slot_len` bytes. Clients are the producers, LogServer the only
+// consumer (a bounded multi-producer queue): a producer claims position
+// pos from enqueue_pos when the slot's seq equals pos, writes its pid,
+// fills the slot and publishes it by changing seq from pos to pos + 1
+// with a compare-and-swap; the consumer reads it, clears pid and sets seq
+// to pos + slots, handing the slot to the producer one lap later. A
+// consumer that finds the ring empty sets `sleeping` and waits on the
+// `wake` futex, which producers bump. A restarted server sets `closed`
+// in the old segment so clients re-attach to the new one.
+//
+// A slot claimed but not published for a while is skipped: the consumer
+// changes seq from pos to pos | LOG_SHM_ABANDONED and moves on, without
+// handing the slot back. A producer that was only slow then fails to
+// publish, hands the slot back itself and reports the datagram as not
+// sent. If the producer's pid no longer exists, the consumer hands the
+// slot back. A producer that dies before writing its pid, or whose pid
+// the server cannot see (another pid namespace), leaves the slot blocked,
+// and producers find the ring full once they come round to it.
+#define LOG_LOCAL_SOCKET "embedded-debug-log"  // Abstract name, no file
+#define LOG_SHM_NAME "/embedded-debug-log"
+#define LOG_SHM_MAGIC 0x4C4F4752u   // "LOGR"
+#define LOG_SHM_VERSION 2
+#define LOG_SHM_SLOTS 1024          // Datagrams the ring holds (power of two)
+#define LOG_SHM_SLOT_LEN 4096       // Largest datagram a slot holds
+#define LOG_SHM_ABANDONED (1ULL << 63) // Set in seq of a slot the consumer skipped
+
+struct log_shm_header {
+    uint32_t magic;       // LOG_SHM_MAGIC
+    uint32_t version;     // LOG_SHM_VERSION
+    uint32_t slots;       // Number of slots, a power of two
+    uint32_t slot_len;    // Payload bytes per slot
+    uint32_t closed;      // Set when the server stopped using the segment
+    uint32_t sleeping;    // Set while the consumer waits on wake
+    uint32_t wake;        // Futex word, bumped by producers to wake the consumer
+    uint32_t reserved;
+    alignas(64) uint64_t enqueue_pos;  // Next position for producers
+    alignas(64) uint64_t dequeue_pos;  // Next position for the consumer
+};
+
+struct log_shm_slot {
+    uint64_t seq;         // Position handshake, see above
+    int32_t pid;          // Producer process, identifies the sender; 0 while the slot is free
+    uint32_t len;         // Bytes of datagram following the slot header
+};
+
+// Returns slot i of the shared-memory ring
+static inline struct log_shm_slot *log_shm_slot_at(struct log_shm_header *hdr, uint32_t i) {
+    return (struct log_shm_slot *)((char *)(hdr + 1) + (size_t)i * (sizeof(struct log_shm_slot) + hdr->slot_len));
+}
+
+// Latency histograms kept by Logger and LogServer. Buckets are
+// log-linear like an HdrHistogram: values below 2^LOG_HIST_SUB_BITS get
+// a bucket each, every power of two above is split into
+// 2^LOG_HIST_SUB_BITS buckets, so a bucket spans at most 1/16 of its
+// value. Values below 2^(LOG_HIST_MAX_BITS + 1) ns (about 36 minutes) are
+// kept apart, larger ones share the last bucket. One thread records into a
+// histogram; others may read and merge it at any time, so fields are
+// accessed with relaxed atomics.
+#define LOG_HIST_SUB_BITS 4
+#define LOG_HIST_MAX_BITS 40
+#define LOG_HIST_BUCKETS ((LOG_HIST_MAX_BITS - LOG_HIST_SUB_BITS + 2) << LOG_HIST_SUB_BITS)
+
+struct log_histogram {
+    uint64_t count;
+    uint64_t sum;         // Of all recorded values, for the mean
+    uint64_t max;
+    uint64_t buckets[LOG_HIST_BUCKETS];
+};
+
+static inline uint32_t log_hist_bucket(uint64_t v) {
+    if (v < (1u << LOG_HIST_SUB_BITS)) return (uint32_t)v;
+    uint32_t bits = 63 - __builtin_clzll(v);  // Position of the top bit, >= LOG_HIST_SUB_BITS
+    if (bits > LOG_HIST_MAX_BITS) return LOG_HIST_BUCKETS - 1;
+    uint32_t sub = (uint32_t)(v >> (bits - LOG_HIST_SUB_BITS)) & ((1u << LOG_HIST_SUB_BITS) - 1);
+    return ((bits - LOG_HIST_SUB_BITS + 1) << LOG_HIST_SUB_BITS) + sub;
+}
+
+// Largest value that falls into bucket b
+static inline uint64_t log_hist_value(uint32_t b) {
+    if (b < (1u << LOG_HIST_SUB_BITS)) return b;
+    uint32_t bits = (b >> LOG_HIST_SUB_BITS) + LOG_HIST_SUB_BITS - 1;
+    uint64_t sub = b & ((1u << LOG_HIST_SUB_BITS) - 1);
+    return (((((uint64_t)1 << LOG_HIST_SUB_BITS) | sub) + 1) << (bits - LOG_HIST_SUB_BITS)) - 1;
+}
+
+// Records one value; only the owning thread calls this
+static inline void log_hist_add(struct log_histogram *h, uint64_t v) {
+    uint32_t b = log_hist_bucket(v);
+    __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+    if (v > h->max) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+// Adds src into dst; src may be recorded into meanwhile
+static inline void log_hist_merge(struct log_histogram *dst, const struct log_histogram *src) {
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max) dst->max = max;
+    for (uint32_t b = 0; b < LOG_HIST_BUCKETS; b++) {
+        dst->buckets[b] += __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED);
+    }
+}
+
+// Value at or below which a fraction p of the recorded values lie
+static inline uint64_t log_hist_percentile(const struct log_histogram *h, double p) {
+    uint64_t total = 0;
+    for (uint32_t b = 0; b < LOG_HIST_BUCKETS; b++) total += h->buckets[b];
+    if (!total) return 0;
+    uint64_t rank = (uint64_t)(p * total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < LOG_HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t v = log_hist_value(b);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif // LOG_PROTOCOL_H
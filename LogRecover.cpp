@@ -0,0 +1,137 @@
+/**
+ * @file LogRecover.cpp
+ * @brief Crash ring recovery tool
+ *
+ * Prints the last records a client kept in its crash ring (see
+ * SetLogCrashRing() and LogProtocol.h), oldest first. Slots a writer was
+ * in the middle of when the client died are skipped.
+ *
+ * Usage: logrecover [-n count] [-u] <name>
+ *   name   shm_open() name such as "/logger.1234", or the path of a copy
+ *          of the segment, e.g. saved from /dev/shm
+ *   -n     print at most this many records (default: all that survived)
+ *   -u     remove the segment afterwards
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "LogProtocol.h"
+
+// A record that survived in the ring
+struct recovered {
+    uint64_t num;           // Record number, the writing order
+    const char *text;
+    uint32_t len;
+};
+
+/**
+ * Orders recovered records by record number.
+ */
+static int by_number(const void *a, const void *b) {
+    uint64_t x = ((const struct recovered *)a)->num;
+    uint64_t y = ((const struct recovered *)b)->num;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    long count = -1;
+    int unlink_after = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:u")) != -1) {
+        if (opt == 'n') {
+            count = atol(optarg);
+        } else if (opt == 'u') {
+            unlink_after = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-n count] [-u] <name>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-n count] [-u] <name>\n", argv[0]);
+        return 1;
+    }
+    const char *name = argv[optind];
+
+    // A name with a '/' past the first character is a file path
+    int is_path = strchr(name + 1, '/') != NULL;
+    int fd = is_path ? open(name, O_RDONLY) : shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror(name);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct log_crash_header)) {
+        fprintf(stderr, "%s: not a crash ring\n", name);
+        close(fd);
+        return 1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    struct log_crash_header *hdr = (struct log_crash_header *)map;
+    if (hdr->magic != LOG_CRASH_MAGIC || hdr->version != LOG_CRASH_VERSION || hdr->slots == 0 ||
+        hdr->slot_size <= sizeof(struct log_crash_slot) ||
+        sizeof(*hdr) + (size_t)hdr->slots * hdr->slot_size > (size_t)st.st_size) {
+        fprintf(stderr, "%s: not a crash ring\n", name);
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    // Collect every complete slot; the ring may still be written to if
+    // the client is alive, so each slot's seq is checked around the read
+    struct recovered *recs = (struct recovered *)malloc(hdr->slots * sizeof(struct recovered));
+    if (!recs) {
+        perror("malloc");
+        munmap(map, st.st_size);
+        return 1;
+    }
+    uint32_t found = 0, torn = 0;
+    uint32_t max_len = hdr->slot_size - sizeof(struct log_crash_slot);
+    for (uint32_t i = 0; i < hdr->slots; i++) {
+        struct log_crash_slot *slot = log_crash_slot_at(hdr, i);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0) continue;  // Never written
+        uint32_t len = slot->len;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((seq & 1) || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq || len > max_len) {
+            torn++;  // Writer was interrupted or is still busy
+            continue;
+        }
+        if ((seq / 2 - 1) % hdr->slots != i || seq / 2 - 1 >= __atomic_load_n(&hdr->next, __ATOMIC_ACQUIRE)) {
+            torn++;  // Sequence of another slot, or of a record never claimed
+            continue;
+        }
+        recs[found].num = seq / 2 - 1;
+        recs[found].text = (const char *)(slot + 1);
+        recs[found].len = len;
+        found++;
+    }
+    qsort(recs, found, sizeof(*recs), by_number);
+
+    uint64_t next = __atomic_load_n(&hdr->next, __ATOMIC_ACQUIRE);
+    fprintf(stderr, "%s: client %.*s pid %d, %llu records logged, %u recovered, %u incomplete\n", name,
+            (int)sizeof(hdr->client_id), hdr->client_id, (int)hdr->pid, (unsigned long long)next, found, torn);
+
+    uint32_t first = count >= 0 && (uint64_t)count < found ? found - (uint32_t)count : 0;
+    for (uint32_t i = first; i < found; i++) {
+        fwrite(recs[i].text, 1, recs[i].len, stdout);
+        fputc('\n', stdout);
+    }
+
+    free(recs);
+    munmap(map, st.st_size);
+    if (unlink_after && !is_path && shm_unlink(name) < 0) {
+        perror("shm_unlink");
+    }
+    return 0;
+}
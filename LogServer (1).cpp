@@ -6,9 +6,19 @@
  * logs them to a file, and allows dynamic log level control.
  *
  * Features:
- * - Receives log messages from clients.
- * - Logs messages to a file.
- * - Allows log level changes via UDP commands.
+ * - Receives log messages from clients on a pool of SO_REUSEPORT workers,
+ *   and from clients on the same host over a Unix datagram socket and a
+ *   shared-memory ring at the same time.
+ * - Logs messages to a file through a double-buffered group-commit
+ *   writer, or to pre-allocated, memory-mapped segment files. A disk thread
+ *   does all file I/O, so receiving never waits for the disk.
+ * - Keeps a sparse receive-time index next to the log data and answers
+ *   time range, level, client and substring queries from it.
+ * - Renders binary client records (LogProtocol.h) to text, resolving
+ *   interned call sites per client.
+ * - Keeps a registry of client processes with per-client statistics.
+ * - Sends log level changes via UDP commands to one client, a group of
+ *   clients or all of them.
  * - Provides a menu-driven interface for server management.
  *
  * 
@@ -22,125 +32,2335 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include "LogProtocol.h"
 
 #define BUF_LEN 1024          // Maximum buffer size for incoming messages
 #define SERVER_PORT 54321     // Port number for the server to listen on
 #define LOG_FILE "server_log.txt" // File where logs will be stored
+#define RECV_BATCH 64         // Datagrams drained per recvmmsg() call
+#define DGRAM_LEN 65536       // Receive buffer per datagram, fits packed client batches
+#define WRITE_BUF_LEN (1 << 20) // Default group-commit buffer size in bytes
+#define FLUSH_INTERVAL_MS 100 // Default longest time a line waits in the write buffer
+#define SYNC_INTERVAL_MS 1000 // fdatasync() period for DURABILITY_PERIODIC
+#define MAX_WORKERS 64        // Upper bound on receive worker threads
+#define SEGMENT_DIR "server_log.d" // Directory holding segment files
+#define SEGMENT_MAGIC "LOGSEG1"    // First bytes of every segment file
+#define SEGMENT_HEADER_LEN 4096    // Header page in front of the segment data
+#define SEGMENTZ_MAGIC "LOGSEGZ"   // First bytes of every compressed segment file
+#define ZBLOCK_LEN 65536      // Largest block of a compressed segment, fits LZ offsets
+#define INDEX_STRIDE 65536    // Bytes of log data between two index entries
+#define QUERY_SLACK_NS 5000000000ULL // Allowed skew between client and receive time
+#define INDEX_NONE UINT64_MAX // Index file has no entry yet
+#define MAX_CLIENTS 4096      // Sender address table slots (power of two)
+#define MAX_CLIENT_IDS 2048   // Client registry slots (power of two)
+#define CLIENT_IDLE_SEC 600   // Forget senders and clients silent this long (> the clients' hello interval)
+#define CLIENT_SWEEP_SEC 10   // Look for silent senders and clients this often
+#define RATE_WINDOW_NS 1000000000ULL // Message rate is measured over windows this long
+#define MAX_SITE_ID 65536     // Largest call-site ID accepted from a client
+#define SHM_STUCK_MS 1000     // Skip a ring slot claimed but not filled for this long
 
 // Global variables for server operation
-static int sockfd = -1; // UDP socket file descriptor
-static pthread_t recv_thread; // Thread for receiving log messages
+static int sockfd = -1; // UDP socket of the first worker, also used to send commands
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for synchronizing log file access
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards the files: segments and the writer's file state
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;  // Signalled with mutex when the disk thread has work
+static pthread_cond_t written_cond = PTHREAD_COND_INITIALIZER; // Signalled with mutex when a buffer was written
+static pthread_t disk_thread;  // Thread running disk_thread_main()
 static int server_running = 1; // Flag to keep the server running
+static int wake_fd = -1; // eventfd signalled at shutdown to wake the receive workers
+static int local_fd = -1; // Unix datagram socket for clients on this host, served by worker 0
+static struct log_shm_header *shm_ring = NULL; // Shared-memory ring for clients on this host
+static size_t shm_size = 0;   // Bytes mapped at shm_ring
+static pthread_t shm_thread;  // Thread consuming shm_ring
 
-// Client information tracking
-static struct sockaddr_in client_addr; // Stores the last sender of a log message
-static struct sockaddr_in recv_client_addr; // Stores client's receive port for log level updates
-static socklen_t client_addr_len = sizeof(client_addr);
-static int client_known = 0; // Flag to indicate if a client has sent a log message
-static int recv_client_known = 0; // Flag to indicate if a client has sent a hello message
+// Hot-path counters of one ingest thread (a receive worker or the
+// shared-memory consumer). Only that thread writes them; the stats menu
+// reads them with relaxed loads.
+struct alignas(64) ingest_stats {
+    uint64_t batches;         // recvmmsg() calls that returned data, or batches taken from the ring
+    uint64_t datagrams;       // Datagrams received
+    uint64_t bytes;           // Bytes received
+    uint64_t records;         // Records queued for the writer
+    struct log_histogram lock_wait; // Waiting for the mutex
+    struct log_histogram handle;    // Handling one batch under the mutex
+};
+
+// A receive worker: one thread draining its own SO_REUSEPORT socket
+struct recv_worker {
+    pthread_t thread;         // Thread running receive_thread()
+    int fd;                   // Socket bound to SERVER_PORT
+    struct ingest_stats stats;
+};
+static struct recv_worker workers[MAX_WORKERS];
+static int num_workers = 1;   // Number of receive workers, set with -w
+static struct ingest_stats shm_stats;  // Of shm_consume_thread()
+static thread_local struct ingest_stats *thread_ingest = NULL; // Stats of the calling ingest thread
+
+// Cost of getting lines to disk. The disk thread updates it, except
+// dropped, which the ingest threads update under the mutex (per client
+// in client_info.overflows).
+struct writer_stats {
+    uint64_t flushes;         // Buffers written
+    uint64_t bytes;           // Bytes written
+    uint64_t dropped;         // Lines dropped because both buffers were full
+    uint64_t lost;            // Bytes a failed or short write() did not store
+    struct log_histogram flush; // One flush: write() or the copy into a segment
+    struct log_histogram sync;  // One fdatasync()/msync()
+};
+static struct writer_stats wstats;
+
+// How hard the writer works to get lines onto stable storage
+enum durability_mode {
+    DURABILITY_NONE = 0,      // Leave write-back to the kernel
+    DURABILITY_PERIODIC = 1,  // fdatasync() every SYNC_INTERVAL_MS
+    DURABILITY_BATCH = 2      // fdatasync() after every buffer flush
+};
+
+// Header at the start of every segment file. Data follows at
+// SEGMENT_HEADER_LEN; the file is pre-allocated, so data_len (not the
+// file size) tells how much of it is in use.
+struct segment_header {
+    char magic[8];            // SEGMENT_MAGIC
+    uint32_t version;         // 1
+    uint32_t header_len;      // SEGMENT_HEADER_LEN
+    uint64_t segment_id;      // Number in the file name
+    uint64_t first_ns;        // Receive time of the first line (CLOCK_REALTIME)
+    uint64_t last_ns;         // Receive time of the last line
+    uint64_t records;         // Lines stored
+    uint64_t data_len;        // Bytes of data in use
+};
+
+// Segment storage engine, guarded by disk_mutex. Segments are named
+// SEGMENT_DIR/<id>.seg with ids increasing; all but the newest are sealed.
+struct segment_store {
+    int enabled;              // Set with -m
+    size_t size;              // Size of each segment file, header included
+    int retain;               // Keep at most this many segments (0 = all), set with -r
+    uint32_t first_id;        // Oldest segment on disk
+    uint32_t next_id;         // Id the next segment will get
+    int fd;                   // Active segment
+    char *map;                // Active segment mapping
+    struct segment_header *hdr; // Header inside map
+    int idx_fd;               // Index file of the active segment
+    uint64_t idx_last;        // Data offset of its last index entry
+};
+static struct segment_store segments = { 0, 0, 0, 1, 1, -1, NULL, NULL, -1, 0 };
+
+// A sealed segment compressed by the compactor (see -z) is replaced by
+// SEGMENT_DIR/<id>.segz: this header, the blocks, then the block table.
+// Blocks are cut on line boundaries and compressed one by one with the LZ
+// codec of LogProtocol.h, so a query decompresses only the blocks its
+// index range covers. The .idx file keeps its uncompressed data offsets.
+struct zsegment_header {
+    struct segment_header seg; // Of the original segment, magic SEGMENTZ_MAGIC
+    uint64_t table_offset;    // File offset of the block table
+    uint64_t blocks;          // Entries in the block table
+};
+
+// Entry of the block table of a compressed segment
+struct zsegment_block {
+    uint64_t data_offset;     // Offset of the block in the uncompressed data
+    uint64_t file_offset;     // Offset of the compressed block in the file
+    uint32_t raw_len;         // Uncompressed size, at most ZBLOCK_LEN
+    uint32_t packed_len;      // Stored size; equal to raw_len for a block kept as is
+};
+
+// Background compression of sealed segments, enabled with -z
+static int compress_segments = 0;
+static pthread_t compact_thread;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER; // Signalled with disk_mutex when a segment is sealed
+
+// One entry of a sparse index file (<log>.idx): lines stored at data
+// offset >= offset were received at or after ns. Entries are appended by
+// the writer at most every INDEX_STRIDE bytes, so offsets and times grow.
+struct index_entry {
+    uint64_t ns;              // Receive time (CLOCK_REALTIME)
+    uint64_t offset;          // Offset into the log data
+};
+
+// Filters of a log query; zero/empty fields match everything
+struct log_query {
+    uint64_t from_key;        // Earliest record time as YYYYMMDDhhmmss * 1e9 + ns, local time
+    uint64_t to_key;          // Latest record time, same encoding (0 = no limit)
+    uint64_t from_ns;         // from_key as receive time in ns since the epoch
+    uint64_t to_ns;           // to_key as receive time (0 = no limit)
+    int min_level;            // Lowest level to show (-1 = all, lines without level included)
+    char client[64];          // Substring of the "ip:port" sender tag
+    char contains[256];       // Substring of the line
+};
+
+// Double-buffered group-commit log file writer. Ingest threads append
+// to the front buffer under the mutex; once it is full or due, it is
+// swapped with the idle back buffer and the disk thread writes it out
+// under disk_mutex, so appending never waits for I/O. The buffers are
+// guarded by mutex, the file state by disk_mutex.
+struct log_writer {
+    int fd;                   // Log file opened for appending
+    char *buf;                // Front buffer, lines not yet handed to the disk thread
+    size_t len;               // Bytes used in buf
+    size_t cap;               // Flush once buf holds this many bytes
+    int flush_ms;             // Flush once the oldest buffered line is this old
+    durability_mode durability;
+    int unsynced;             // Data written since the last fdatasync()
+    struct timespec first;    // When the oldest buffered line was appended
+    struct timespec last_sync; // When fdatasync() last ran
+    uint64_t first_ns;        // Receive time of the oldest buffered line
+    uint64_t last_ns;         // Receive time of the newest buffered line
+    int idx_fd;               // Index of LOG_FILE when not using segments
+    uint64_t file_len;        // Bytes in LOG_FILE
+    uint64_t idx_last;        // File offset of the last index entry
+    char *spare;              // Idle back buffer, NULL while the disk thread owns it
+    char *back;               // Back buffer handed to the disk thread, or NULL
+    size_t back_len;          // Bytes used in back
+    uint64_t back_first_ns;   // Receive times of its oldest and newest line
+    uint64_t back_last_ns;
+    uint64_t swaps;           // Buffers handed to the disk thread so far
+    uint64_t written;         // Of those, buffers the disk thread has written
+    int flush_wanted;         // Hand over the front buffer now, see writer_drain()
+    int stop;                 // Disk thread exits once both buffers are written
+};
+static struct log_writer writer = { -1, NULL, 0, WRITE_BUF_LEN, FLUSH_INTERVAL_MS, DURABILITY_NONE, 0, {0, 0}, {0, 0}, 0, 0, -1, 0, 0,
+                                    NULL, NULL, 0, 0, 0, 0, 0, 0, 0 };
+
+// A client process, registered by the id in its hello messages. Clients
+// that send no id are registered under the "ip:port" they send from.
+struct client_info {
+    int used;
+    char id[64];
+    char group[32];
+    struct sockaddr_in ctrl;  // Where level commands for this client go
+    int ctrl_known;           // Set once the recv_socket hello arrived
+    uint64_t msgs;            // Records received
+    uint64_t bytes;           // Datagram bytes received
+    uint64_t drops;           // Records that could not be decoded
+    uint64_t overflows;       // Records the writer dropped because both buffers were full
+    struct sockaddr_storage data; // Address the client sends records from
+    int seq_known;            // Set once a sequence number arrived from data
+    uint64_t seq_next;        // Sequence number expected next
+    uint64_t seq_records;     // Records received with sequence numbers
+    uint64_t lost;            // Records missing from the sequence
+    uint64_t reordered;       // Datagrams that arrived after a later one
+    time_t last_seen;         // Wall time of the last datagram
+    uint64_t win_start;       // Start of the current rate window (ns)
+    uint64_t win_msgs;        // Records received in the current window
+    double rate;              // Records per second over the last full window
+};
+static struct client_info client_ids[MAX_CLIENT_IDS]; // Open-addressed by id, guarded by mutex
+static int num_client_ids = 0;
+
+// A call site announced by a client
+struct site_entry {
+    char *file;               // NULL until announced
+    char *func;
+    char *fmt;                // Format string of LOG_WIRE_FMT_SITE sites, else NULL
+    uint32_t line;
+};
+
+// Per-sender state, keyed by source address and guarded by mutex
+struct client_entry {
+    int used;
+    struct sockaddr_storage addr; // UDP or Unix socket address, or shared-memory sender
+    struct site_entry *sites; // Indexed by call-site ID
+    uint32_t num_sites;       // Allocated length of sites
+    struct client_info *info; // Registry entry of the process sending from addr
+    time_t last_seen;         // Wall time of the last datagram from addr
+};
+static struct client_entry clients[MAX_CLIENTS]; // Open-addressed by address
+static int num_clients = 0;
+static time_t clients_now = 0;   // Wall time of the datagram being handled
+static time_t clients_swept = 0; // When expire_clients() last ran
+
+/**
+ * @brief Returns the milliseconds elapsed since start.
+ */
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000L + (now.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds, for measuring.
+ */
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Adds n to a counter only its owner thread writes.
+ */
+static inline void stat_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the current wall-clock time in nanoseconds.
+ */
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Builds the path of a segment file, or of its index ("idx") or
+ * compressed form ("segz") given the extension.
+ */
+static void segment_path(uint32_t id, char *path, size_t len, const char *ext = "seg") {
+    snprintf(path, len, "%s/%08u.%s", SEGMENT_DIR, id, ext);
+}
+
+/**
+ * @brief Opens an index file for appending.
+ *
+ * An index left by an earlier run is continued: a partly written last entry
+ * is cut off and the offset of the last whole one is read back, so the
+ * next entries keep their INDEX_STRIDE spacing.
+ *
+ * @param path Index file.
+ * @param last Set to the offset of the last entry, or INDEX_NONE.
+ * @return The descriptor, or -1 on failure (the log still works unindexed).
+ */
+static int index_open(const char *path, uint64_t *last) {
+    *last = INDEX_NONE;
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) {
+        perror("open index");
+        return -1;
+    }
+    fchmod(fd, 0666);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        off_t whole = st.st_size - st.st_size % (off_t)sizeof(struct index_entry);
+        if (whole != st.st_size && ftruncate(fd, whole) < 0) perror("ftruncate index");
+        struct index_entry e;
+        if (whole > 0 && pread(fd, &e, sizeof(e), whole - sizeof(e)) == (ssize_t)sizeof(e)) *last = e.offset;
+    }
+    return fd;
+}
+
+/**
+ * @brief Adds an index entry when INDEX_STRIDE bytes were written since the
+ * last one, or when the index is still empty.
+ *
+ * @param fd Index file.
+ * @param last Offset of the last entry (INDEX_NONE if none), updated.
+ * @param ns Receive time of the line at offset.
+ * @param offset Data offset where the next write starts.
+ */
+static void index_add(int fd, uint64_t *last, uint64_t ns, uint64_t offset) {
+    if (fd < 0 || (*last != INDEX_NONE && offset - *last < INDEX_STRIDE)) return;
+    struct index_entry e = { ns, offset };
+    if (write(fd, &e, sizeof(e)) == (ssize_t)sizeof(e)) *last = offset;
+}
+
+/**
+ * @brief Creates, pre-allocates and maps the next segment.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int segment_create() {
+    char path[256];
+    uint32_t id = segments.next_id;
+    segment_path(id, path, sizeof(path));
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror("open segment");
+        return -1;
+    }
+    fchmod(fd, 0666);
+
+    // Reserve the blocks up front so appends never extend the file
+    if (fallocate(fd, 0, 0, segments.size) < 0 && ftruncate(fd, segments.size) < 0) {
+        perror("fallocate");
+        close(fd);
+        return -1;
+    }
+    char *map = (char *)mmap(NULL, segments.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
+
+    struct segment_header *hdr = (struct segment_header *)map;
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    hdr->version = 1;
+    hdr->header_len = SEGMENT_HEADER_LEN;
+    hdr->segment_id = id;
+
+    segments.fd = fd;
+    segments.map = map;
+    segments.hdr = hdr;
+    segments.next_id = id + 1;
+
+    segment_path(id, path, sizeof(path), "idx");
+    unlink(path);
+    segments.idx_fd = index_open(path, &segments.idx_last);
+    return 0;
+}
+
+/**
+ * @brief Flushes the active segment's mapping to disk.
+ */
+static void segment_sync() {
+    if (segments.map) {
+        msync(segments.map, SEGMENT_HEADER_LEN + segments.hdr->data_len, MS_SYNC);
+    }
+}
+
+/**
+ * @brief Unmaps and closes the active segment.
+ */
+static void segment_seal() {
+    if (!segments.map) return;
+    if (writer.durability != DURABILITY_NONE) segment_sync();
+    munmap(segments.map, segments.size);
+    close(segments.fd);
+    if (segments.idx_fd >= 0) close(segments.idx_fd);
+    segments.map = NULL;
+    segments.hdr = NULL;
+    segments.fd = -1;
+    segments.idx_fd = -1;
+}
+
+/**
+ * @brief Seals the active segment, applies retention and starts a new one.
+ *
+ * Retention drops whole segments, oldest first, with one unlink() each.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int segment_roll() {
+    segment_seal();
+    while (segments.retain && segments.next_id - segments.first_id >= (uint32_t)segments.retain) {
+        char path[256];
+        segment_path(segments.first_id, path, sizeof(path), "idx");
+        unlink(path);
+        segment_path(segments.first_id, path, sizeof(path), "segz");
+        unlink(path);
+        segment_path(segments.first_id++, path, sizeof(path));
+        unlink(path);
+    }
+    if (compress_segments) pthread_cond_signal(&compact_cond);
+    return segment_create();
+}
+
+/**
+ * @brief Copies lines into the active segment, rolling to a new segment
+ * when the next line does not fit. Lines never straddle two segments.
+ *
+ * @param data Whole lines, each ending in a newline.
+ * @param len Length of data.
+ * @param first_ns Receive time of the first line.
+ * @param last_ns Receive time of the last line.
+ */
+static void segment_write(const char *data, size_t len, uint64_t first_ns, uint64_t last_ns) {
+    while (len > 0) {
+        if (!segments.map && segment_create() < 0) return;
+        struct segment_header *hdr = segments.hdr;
+        size_t room = segments.size - SEGMENT_HEADER_LEN - hdr->data_len;
+        size_t n = len;
+        if (n > room) {
+            // Cut after the last complete line that fits
+            const char *cut = room ? (const char *)memrchr(data, '\n', room) : NULL;
+            if (cut) {
+                n = cut - data + 1;
+            } else if (hdr->data_len > 0) {
+                if (segment_roll() < 0) return;
+                continue;
+            } else {
+                n = room;  // A single line longer than a segment
+            }
+        }
+
+        index_add(segments.idx_fd, &segments.idx_last, first_ns, hdr->data_len);
+        memcpy(segments.map + SEGMENT_HEADER_LEN + hdr->data_len, data, n);
+        uint64_t lines = 0;
+        for (const char *p = data; (p = (const char *)memchr(p, '\n', data + n - p)); p++) lines++;
+        if (hdr->records == 0) hdr->first_ns = first_ns;
+        hdr->last_ns = last_ns;
+        hdr->records += lines;
+        hdr->data_len += n;  // Publish the data only after it is in place
+
+        data += n;
+        len -= n;
+        if (len > 0 && segment_roll() < 0) return;
+    }
+}
+
+/**
+ * @brief Finds the segments left by earlier runs and starts a new one
+ * after them.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int segment_store_open() {
+    if (mkdir(SEGMENT_DIR, 0777) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+
+    DIR *dir = opendir(SEGMENT_DIR);
+    if (!dir) {
+        perror("opendir");
+        return -1;
+    }
+    uint32_t min_id = 0, max_id = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        unsigned id;
+        char ext[8];
+        if (sscanf(ent->d_name, "%u.%7s", &id, ext) == 2 && (strcmp(ext, "seg") == 0 || strcmp(ext, "segz") == 0) &&
+            id > 0) {
+            if (!min_id || id < min_id) min_id = id;
+            if (id > max_id) max_id = id;
+        }
+    }
+    closedir(dir);
+
+    segments.first_id = min_id ? min_id : 1;
+    segments.next_id = max_id + 1;
+    return segment_roll();
+}
+
+/**
+ * @brief Writes the compressed form of a sealed segment and replaces the
+ * segment with it.
+ *
+ * Runs without disk_mutex; the segment is no longer written to. The new
+ * file is written under a temporary name and renamed before the segment
+ * is removed, so queries always find one of the two.
+ *
+ * @param id Segment to compress.
+ * @param ctx Match finder state of the calling thread.
+ * @return 0 on success or when there is nothing to do, -1 on failure.
+ */
+static int segment_compress(uint32_t id, struct log_lz_ctx *ctx) {
+    char path[256], tmp[256];
+    segment_path(id, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;  // Already compressed or removed by retention
+
+    struct segment_header hdr;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0) {
+        close(fd);
+        return 0;  // Not ours to compress
+    }
+    size_t map_len = SEGMENT_HEADER_LEN + hdr.data_len;
+    const char *map = (const char *)mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    const char *data = map + SEGMENT_HEADER_LEN;
+
+    snprintf(tmp, sizeof(tmp), "%s/%08u.segz.tmp", SEGMENT_DIR, id);
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+        perror("open compressed segment");
+        munmap((void *)map, map_len);
+        return -1;
+    }
+    fchmod(out, 0666);
+
+    size_t max_blocks = hdr.data_len / (ZBLOCK_LEN / 2) + 1;  // Cuts leave at least half a block but for long lines
+    struct zsegment_block *table = (struct zsegment_block *)malloc(max_blocks * sizeof(*table));
+    uint8_t *packed = (uint8_t *)malloc(LOG_LZ_BOUND(ZBLOCK_LEN));
+    uint64_t file_off = sizeof(struct zsegment_header);
+    uint64_t off = 0, blocks = 0;
+    int ok = table && packed;
+    while (ok && off < hdr.data_len && server_running) {
+        uint32_t n = hdr.data_len - off < ZBLOCK_LEN ? hdr.data_len - off : ZBLOCK_LEN;
+        if (off + n < hdr.data_len) {
+            // Cut after the last complete line, unless it would leave a tiny block
+            const char *cut = (const char *)memrchr(data + off, '\n', n);
+            if (cut && cut - (data + off) + 1 >= ZBLOCK_LEN / 2) n = cut - (data + off) + 1;
+        }
+        if (blocks == max_blocks) {
+            max_blocks *= 2;
+            struct zsegment_block *grown = (struct zsegment_block *)realloc(table, max_blocks * sizeof(*table));
+            if (!grown) break;
+            table = grown;
+        }
+        // Capacity n - 1: a block is stored compressed only if that saves
+        // bytes, since readers take packed_len == raw_len to mean raw
+        int len = log_lz_compress(ctx, (const uint8_t *)data + off, n, packed, n - 1);
+        const void *src = len > 0 ? (const void *)packed : (const void *)(data + off);
+        struct zsegment_block *b = &table[blocks++];
+        b->data_offset = off;
+        b->file_offset = file_off;
+        b->raw_len = n;
+        b->packed_len = len > 0 ? (uint32_t)len : n;
+        ok = pwrite(out, src, b->packed_len, file_off) == (ssize_t)b->packed_len;
+        file_off += b->packed_len;
+        off += n;
+    }
+    munmap((void *)map, map_len);
+
+    struct zsegment_header zhdr;
+    memset(&zhdr, 0, sizeof(zhdr));
+    zhdr.seg = hdr;
+    memcpy(zhdr.seg.magic, SEGMENTZ_MAGIC, sizeof(SEGMENTZ_MAGIC));
+    zhdr.seg.header_len = sizeof(zhdr);
+    zhdr.table_offset = file_off;
+    zhdr.blocks = blocks;
+    ok = ok && off == hdr.data_len &&
+         pwrite(out, table, blocks * sizeof(*table), file_off) == (ssize_t)(blocks * sizeof(*table)) &&
+         pwrite(out, &zhdr, sizeof(zhdr), 0) == (ssize_t)sizeof(zhdr) &&
+         (writer.durability == DURABILITY_NONE || fdatasync(out) == 0);
+    close(out);
+    free(table);
+    free(packed);
+
+    // Retention may have dropped the segment while it was compressed
+    pthread_mutex_lock(&disk_mutex);
+    if (!ok || id < segments.first_id) {
+        unlink(tmp);
+    } else {
+        char zpath[256];
+        segment_path(id, zpath, sizeof(zpath), "segz");
+        if (rename(tmp, zpath) == 0) unlink(path);
+        else ok = 0;
+    }
+    pthread_mutex_unlock(&disk_mutex);
+    if (!ok && server_running) fprintf(stderr, "Failed to compress segment %u\n", id);
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Compresses sealed segments in the background, oldest first,
+ * including those left uncompressed by earlier runs.
+ */
+static void *compact_thread_main(void *arg) {
+    (void)arg;
+    struct log_lz_ctx *ctx = (struct log_lz_ctx *)calloc(1, sizeof(struct log_lz_ctx));
+    if (!ctx) {
+        perror("calloc");
+        return NULL;
+    }
+    uint32_t next = 0;
+    pthread_mutex_lock(&disk_mutex);
+    while (server_running) {
+        if (next < segments.first_id) next = segments.first_id;
+        if (next + 1 >= segments.next_id) {
+            // Only the active segment left; rolls signal, the timeout covers shutdown
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec++;
+            pthread_cond_timedwait(&compact_cond, &disk_mutex, &until);
+            continue;
+        }
+        uint32_t id = next++;
+        pthread_mutex_unlock(&disk_mutex);
+        segment_compress(id, ctx);
+        pthread_mutex_lock(&disk_mutex);
+    }
+    pthread_mutex_unlock(&disk_mutex);
+    free(ctx);
+    return NULL;
+}
+
+/**
+ * @brief Opens the log storage and allocates the two write buffers.
+ *
+ * @param path Log file to append to when the segment store is not enabled.
+ * @return 0 on success, -1 on failure.
+ */
+static int writer_open(const char *path) {
+    if (segments.enabled) {
+        if (segment_store_open() < 0) return -1;
+    } else {
+        writer.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (writer.fd < 0) {
+            perror("open");
+            return -1;
+        }
+
+        // Set appropriate permissions for the log file
+        fchmod(writer.fd, 0666);
+
+        struct stat st;
+        writer.file_len = fstat(writer.fd, &st) == 0 ? st.st_size : 0;
+        char idx_path[256];
+        snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+        writer.idx_fd = index_open(idx_path, &writer.idx_last);
+    }
+
+    writer.buf = (char *)malloc(writer.cap);
+    writer.spare = (char *)malloc(writer.cap);
+    if (!writer.buf || !writer.spare) {
+        perror("malloc");
+        free(writer.buf);
+        free(writer.spare);
+        if (segments.enabled) segment_seal();
+        else close(writer.fd);
+        writer.fd = -1;
+        return -1;
+    }
+    writer.len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &writer.last_sync);
+    return 0;
+}
+
+/**
+ * @brief Makes written data durable.
+ *
+ * Must be called with disk_mutex held.
+ */
+static void writer_sync() {
+    uint64_t start = monotonic_ns();
+    if (segments.enabled) segment_sync();
+    else fdatasync(writer.fd);
+    log_hist_add(&wstats.sync, monotonic_ns() - start);
+    writer.unsynced = 0;
+    clock_gettime(CLOCK_MONOTONIC, &writer.last_sync);
+}
+
+/**
+ * @brief Writes a buffer of lines to the log file in one go, or copies
+ * them into the active segment.
+ *
+ * Must be called with disk_mutex held.
+ *
+ * @param data Whole lines, each ending in a newline.
+ * @param len Length of data.
+ * @param first_ns Receive time of the first line.
+ * @param last_ns Receive time of the last line.
+ */
+static void writer_write(const char *data, size_t len, uint64_t first_ns, uint64_t last_ns) {
+    if (len == 0) return;
+    uint64_t start = monotonic_ns();
+    size_t off = 0;
+    if (segments.enabled) {
+        segment_write(data, len, first_ns, last_ns);
+        off = len;
+    } else {
+        index_add(writer.idx_fd, &writer.idx_last, first_ns, writer.file_len);
+    }
+    while (off < len) {
+        ssize_t n = write(writer.fd, data + off, len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            break;
+        }
+        off += n;
+        if (!segments.enabled) writer.file_len += n;
+    }
+    writer.unsynced = 1;
+    stat_add(&wstats.flushes, 1);
+    stat_add(&wstats.bytes, off);
+    if (off < len) stat_add(&wstats.lost, len - off);
+    log_hist_add(&wstats.flush, monotonic_ns() - start);
+
+    if (writer.durability == DURABILITY_BATCH) {
+        writer_sync();
+    }
+}
+
+/**
+ * @brief Hands the front buffer to the disk thread and continues in the
+ * idle back buffer.
+ *
+ * Must be called with the mutex held, with lines in the front buffer and
+ * the back buffer idle.
+ */
+static void writer_swap() {
+    writer.back = writer.buf;
+    writer.back_len = writer.len;
+    writer.back_first_ns = writer.first_ns;
+    writer.back_last_ns = writer.last_ns;
+    writer.buf = writer.spare;
+    writer.spare = NULL;
+    writer.len = 0;
+    writer.swaps++;
+    writer.flush_wanted = 0;
+    pthread_cond_signal(&writer_cond);
+}
+
+/**
+ * @brief Appends one line to the front buffer. A full buffer is swapped
+ * with the back buffer; if the disk thread is still writing that one, the
+ * line is dropped rather than waiting for the disk.
+ *
+ * Must be called with the mutex held.
+ *
+ * @param tag Sender tag written in front of the line.
+ * @param tag_len Length of tag.
+ * @param line Line without its trailing newline.
+ * @param len Length of line.
+ * @return 0 if the line was buffered, -1 if it was dropped.
+ */
+static int writer_append(const char *tag, size_t tag_len, const char *line, size_t len) {
+    if (writer.len + tag_len + len + 1 > writer.cap) {
+        if (writer.back) {
+            stat_add(&wstats.dropped, 1);
+            return -1;
+        }
+        writer_swap();
+    }
+    if (tag_len + len + 1 > writer.cap) {
+        len = writer.cap - tag_len - 1;  // Line larger than the whole buffer, truncate it
+    }
+    writer.last_ns = realtime_ns();
+    if (writer.len == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &writer.first);
+        writer.first_ns = writer.last_ns;
+        pthread_cond_signal(&writer_cond);  // Starts the flush deadline
+    }
+    memcpy(writer.buf + writer.len, tag, tag_len);
+    memcpy(writer.buf + writer.len + tag_len, line, len);
+    writer.buf[writer.len + tag_len + len] = '\n';
+    writer.len += tag_len + len + 1;
+    return 0;
+}
+
+/**
+ * @brief Waits until every line appended so far has been written.
+ *
+ * Must be called with the mutex held, which is released while waiting.
+ */
+static void writer_drain() {
+    uint64_t target = writer.swaps + (writer.len ? 1 : 0);
+    while (writer.written < target) {
+        writer.flush_wanted = 1;
+        pthread_cond_signal(&writer_cond);
+        pthread_cond_wait(&written_cond, &mutex);
+    }
+}
+
+/**
+ * @brief Thread function that does all of the writer's file I/O.
+ *
+ * Takes the front buffer once its oldest line is flush_ms old or a drain
+ * asks for it, and a full one as soon as it is swapped in; writes it
+ * under disk_mutex without holding the mutex, and runs the periodic
+ * fdatasync(). Exits once writer.stop is set and everything is written.
+ */
+static void *disk_thread_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&mutex);
+    for (;;) {
+        if (!writer.back && writer.len &&
+            (writer.stop || writer.flush_wanted || elapsed_ms(&writer.first) >= writer.flush_ms)) {
+            writer_swap();
+        }
+        if (writer.back) {
+            char *data = writer.back;
+            size_t len = writer.back_len;
+            uint64_t first_ns = writer.back_first_ns, last_ns = writer.back_last_ns;
+            pthread_mutex_unlock(&mutex);
+            pthread_mutex_lock(&disk_mutex);
+            writer_write(data, len, first_ns, last_ns);
+            pthread_mutex_unlock(&disk_mutex);
+            pthread_mutex_lock(&mutex);
+            writer.spare = data;
+            writer.back = NULL;
+            writer.written++;
+            pthread_cond_broadcast(&written_cond);
+            continue;
+        }
+        if (writer.stop) break;
+
+        // Sleep until the next flush or sync deadline, or until woken;
+        // unsynced and last_sync are only changed by this thread
+        long timeout = writer.len ? writer.flush_ms - elapsed_ms(&writer.first) : -1;
+        if (writer.durability == DURABILITY_PERIODIC && writer.unsynced) {
+            long age = elapsed_ms(&writer.last_sync);
+            if (age >= SYNC_INTERVAL_MS) {
+                pthread_mutex_unlock(&mutex);
+                pthread_mutex_lock(&disk_mutex);
+                writer_sync();
+                pthread_mutex_unlock(&disk_mutex);
+                pthread_mutex_lock(&mutex);
+                continue;
+            }
+            if (timeout < 0 || SYNC_INTERVAL_MS - age < timeout) timeout = SYNC_INTERVAL_MS - age;
+        }
+        if (timeout < 0) {
+            pthread_cond_wait(&writer_cond, &mutex);
+        } else if (timeout > 0) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += timeout / 1000;
+            until.tv_nsec += (timeout % 1000) * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&writer_cond, &mutex, &until);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+}
+
+/**
+ * @brief Flushes and syncs what is left, then closes the log file. Called
+ * after the disk thread has exited.
+ */
+static void writer_close() {
+    writer_write(writer.buf, writer.len, writer.first_ns, writer.last_ns);
+    writer.len = 0;
+    if (writer.durability != DURABILITY_NONE && writer.unsynced) {
+        writer_sync();
+    }
+    if (segments.enabled) segment_seal();
+    else close(writer.fd);
+    if (writer.idx_fd >= 0) close(writer.idx_fd);
+    free(writer.buf);
+    free(writer.spare);
+    writer.fd = -1;
+    writer.buf = NULL;
+    writer.spare = NULL;
+}
+
+/**
+ * @brief Renders a binary record as the text line a text-mode client sends.
+ *
+ * @param out Output buffer.
+ * @param cap Size of out.
+ * @param rec Decoded record.
+ * @return Length of the line, truncated to cap - 1.
+ */
+static int render_record(char *out, size_t cap, const struct log_wire_record *rec) {
+    static const char *level_str[] = {"DEBUG", "WARNING", "ERROR", "CRITICAL"};
+    const char *level = rec->level < 4 ? level_str[rec->level] : "UNKNOWN";
+
+    time_t sec = rec->timestamp_ns / 1000000000ULL;
+    long usec = (rec->timestamp_ns % 1000000000ULL) / 1000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    char date[32], year[8];
+    strftime(date, sizeof(date), "%a %b %e %H:%M:%S", &tm);
+    strftime(year, sizeof(year), "%Y", &tm);
+
+    int n = snprintf(out, cap, "%s.%06ld %s %s %.*s:%.*s:%u %.*s", date, usec, year, level,
+                     (int)rec->file_len, rec->file, (int)rec->func_len, rec->func, rec->line,
+                     (int)rec->msg_len, rec->msg);
+    if (n < 0) return 0;
+    if ((size_t)n >= cap) n = cap - 1;
+    return n;
+}
+
+/**
+ * @brief Checks whether two sender addresses are the same.
+ *
+ * Unix addresses must be zero-filled past their name.
+ */
+static int peer_equal(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) return 0;
+    if (a->ss_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in *)a, *y = (const struct sockaddr_in *)b;
+        return x->sin_addr.s_addr == y->sin_addr.s_addr && x->sin_port == y->sin_port;
+    }
+    const struct sockaddr_un *x = (const struct sockaddr_un *)a, *y = (const struct sockaddr_un *)b;
+    return memcmp(x->sun_path, y->sun_path, sizeof(x->sun_path)) == 0;
+}
+
+/**
+ * @brief Formats a sender address for tags and client ids.
+ *
+ * UDP senders print as "ip:port", Unix socket senders as "unix:<name>" of
+ * their autobound address, shared-memory senders as "shm:<pid>".
+ */
+static void peer_name(const struct sockaddr_storage *addr, char *out, size_t len) {
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+        snprintf(out, len, "%s:%u", ip, ntohs(in->sin_port));
+    } else {
+        const struct sockaddr_un *un = (const struct sockaddr_un *)addr;
+        // Autobound and "shm:<pid>" names are short; longer ones are cut
+        if (un->sun_path[0]) {
+            snprintf(out, len, "%.32s", un->sun_path);
+        } else {
+            snprintf(out, len, "unix:%.26s", un->sun_path + 1);
+        }
+    }
+}
+
+/**
+ * @brief Hashes a sender address to its home slot in clients.
+ */
+static uint32_t client_slot(const struct sockaddr_storage *addr) {
+    uint32_t h;
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        h = (ntohl(in->sin_addr.s_addr) * 2654435761u) ^ ntohs(in->sin_port);
+    } else {
+        const struct sockaddr_un *un = (const struct sockaddr_un *)addr;
+        h = 2166136261u;
+        for (size_t i = 0; i < sizeof(un->sun_path); i++) h = (h ^ (uint8_t)un->sun_path[i]) * 16777619u;
+    }
+    return h & (MAX_CLIENTS - 1);
+}
+
+/**
+ * @brief Hashes a client id to its home slot in client_ids.
+ */
+static uint32_t client_id_slot(const char *id) {
+    uint32_t h = 2166136261u;
+    for (const char *p = id; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+    return h & (MAX_CLIENT_IDS - 1);
+}
+
+/**
+ * @brief Finds or creates the entry for a sender address.
+ *
+ * The table is kept at most three quarters full, so a probe for an
+ * unknown address ends at a free slot early.
+ * Must be called with the mutex held.
+ *
+ * @param addr Source address of a datagram.
+ * @return The entry, or NULL when the table is full.
+ */
+static struct client_entry *lookup_client(const struct sockaddr_storage *addr) {
+    uint32_t h = client_slot(addr);
+    for (uint32_t i = 0; i < MAX_CLIENTS; i++) {
+        struct client_entry *c = &clients[(h + i) & (MAX_CLIENTS - 1)];
+        if (!c->used) {
+            if (num_clients >= MAX_CLIENTS / 4 * 3) return NULL;
+            memset(c, 0, sizeof(*c));
+            c->used = 1;
+            c->addr = *addr;
+            c->last_seen = clients_now;
+            num_clients++;
+            return c;
+        }
+        if (peer_equal(&c->addr, addr)) {
+            c->last_seen = clients_now;
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds or creates the registry entry of a client id.
+ *
+ * Kept at most three quarters full, like clients.
+ * Must be called with the mutex held.
+ *
+ * @param id Client id, at most 63 characters are kept.
+ * @return The entry, or NULL when the registry is full.
+ */
+static struct client_info *lookup_client_id(const char *id) {
+    uint32_t h = client_id_slot(id);
+    for (uint32_t i = 0; i < MAX_CLIENT_IDS; i++) {
+        struct client_info *info = &client_ids[(h + i) & (MAX_CLIENT_IDS - 1)];
+        if (!info->used) {
+            if (num_client_ids >= MAX_CLIENT_IDS / 4 * 3) return NULL;
+            memset(info, 0, sizeof(*info));
+            info->used = 1;
+            snprintf(info->id, sizeof(info->id), "%s", id);
+            strcpy(info->group, "default");
+            num_client_ids++;
+            return info;
+        }
+        if (strncmp(info->id, id, sizeof(info->id) - 1) == 0) return info;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Frees the site table of a sender entry.
+ */
+static void free_sites(struct client_entry *c) {
+    for (uint32_t j = 0; j < c->num_sites; j++) {
+        free(c->sites[j].file);
+        free(c->sites[j].func);
+        free(c->sites[j].fmt);
+    }
+    free(c->sites);
+    c->sites = NULL;
+    c->num_sites = 0;
+}
+
+/**
+ * @brief Removes a sender entry. Later entries of the probe chain are
+ * shifted back into the hole, so lookups need no tombstones.
+ */
+static void remove_client(uint32_t hole) {
+    free_sites(&clients[hole]);
+    for (uint32_t j = (hole + 1) & (MAX_CLIENTS - 1); clients[j].used; j = (j + 1) & (MAX_CLIENTS - 1)) {
+        // An entry may move back unless its home slot lies after the hole
+        uint32_t home = client_slot(&clients[j].addr);
+        if (((j - home) & (MAX_CLIENTS - 1)) >= ((j - hole) & (MAX_CLIENTS - 1))) {
+            clients[hole] = clients[j];
+            hole = j;
+        }
+    }
+    memset(&clients[hole], 0, sizeof(clients[hole]));
+    num_clients--;
+}
+
+/**
+ * @brief Removes a registry entry like remove_client(), and repoints the
+ * sender entries that refer to the entries it moves.
+ */
+static void remove_client_id(uint32_t hole) {
+    struct client_info *gone = &client_ids[hole];
+    for (int k = 0; k < MAX_CLIENTS; k++) {
+        if (clients[k].info == gone) clients[k].info = NULL;
+    }
+    for (uint32_t j = (hole + 1) & (MAX_CLIENT_IDS - 1); client_ids[j].used; j = (j + 1) & (MAX_CLIENT_IDS - 1)) {
+        uint32_t home = client_id_slot(client_ids[j].id);
+        if (((j - home) & (MAX_CLIENT_IDS - 1)) >= ((j - hole) & (MAX_CLIENT_IDS - 1))) {
+            client_ids[hole] = client_ids[j];
+            for (int k = 0; k < MAX_CLIENTS; k++) {
+                if (clients[k].info == &client_ids[j]) clients[k].info = &client_ids[hole];
+            }
+            hole = j;
+        }
+    }
+    memset(&client_ids[hole], 0, sizeof(client_ids[hole]));
+    num_client_ids--;
+}
+
+/**
+ * @brief Forgets senders and clients that have been silent for
+ * CLIENT_IDLE_SEC, so restarted processes, which come back under a new
+ * "<host>:<pid>" id and port, do not fill the tables for good. Clients
+ * repeat their hellos well within that time, so live ones are kept.
+ * Runs every CLIENT_SWEEP_SEC, before a datagram is looked up, as entries
+ * move. Must be called with the mutex held.
+ */
+static void expire_clients() {
+    if (clients_now - clients_swept < CLIENT_SWEEP_SEC) return;
+    clients_swept = clients_now;
+    // A slot is checked again after a removal, another entry may have moved in
+    for (uint32_t i = 0; i < MAX_CLIENTS; i++) {
+        while (clients[i].used && clients_now - clients[i].last_seen > CLIENT_IDLE_SEC) remove_client(i);
+    }
+    for (uint32_t i = 0; i < MAX_CLIENT_IDS; i++) {
+        while (client_ids[i].used && clients_now - client_ids[i].last_seen > CLIENT_IDLE_SEC) remove_client_id(i);
+    }
+}
+
+/**
+ * @brief Registers a client from a "Client Hello from ..." message.
+ *
+ * A hello from send_socket binds the sender address to the client, one
+ * from recv_socket records where level commands go. Hellos without an id
+ * (older clients) register the sending address as id.
+ * Must be called with the mutex held.
+ *
+ * @param buf Null-terminated hello message.
+ * @param c Address entry of the sender.
+ * @param src_addr Address the hello came from.
+ */
+static void client_hello(const char *buf, struct client_entry *c, const struct sockaddr_storage *src_addr) {
+    char id[64], group[32] = "";
+    const char *id_at = strstr(buf, " id=");
+    if (id_at) {
+        sscanf(id_at + 4, "%63s", id);
+    } else {
+        peer_name(src_addr, id, sizeof(id));
+    }
+    const char *group_at = strstr(buf, " group=");
+    if (group_at) sscanf(group_at + 7, "%31s", group);
+
+    struct client_info *info = lookup_client_id(id);
+    if (!info) return;
+    info->last_seen = clients_now;
+    if (group[0]) strcpy(info->group, group);
+    // Older clients send no id; their commands go to whichever socket said hello
+    if ((!id_at || strstr(buf, "recv_socket")) && src_addr->ss_family == AF_INET) {
+        info->ctrl = *(const struct sockaddr_in *)src_addr;  // Commands only go over UDP
+        info->ctrl_known = 1;
+    }
+    if (strstr(buf, "send_socket") && c) {
+        // A new address means a new process; its numbering starts over
+        if (!peer_equal(&info->data, src_addr)) {
+            info->data = *src_addr;
+            info->seq_known = 0;
+        }
+        c->info = info;
+    }
+}
+
+/**
+ * @brief Returns the registry entry of the client behind an address.
+ *
+ * Senders that have not said hello are registered under their address.
+ * Must be called with the mutex held.
+ *
+ * @return The entry, or NULL when c is NULL or the registry is full.
+ */
+static struct client_info *client_info_of(struct client_entry *c) {
+    if (!c) return NULL;
+    if (!c->info) {
+        char id[64];
+        peer_name(&c->addr, id, sizeof(id));
+        c->info = lookup_client_id(id);
+        if (c->info) c->info->data = c->addr;
+    }
+    return c->info;
+}
+
+/**
+ * @brief Checks the sequence number of a datagram for lost records.
+ *
+ * A jump forward counts the skipped records as lost. A datagram older than
+ * the newest one seen arrived out of order; its records were counted as
+ * lost when the jump was seen, so they are taken back.
+ * Must be called with the mutex held.
+ *
+ * @param c Address entry of the sender.
+ * @param seq Sequence number of the first record in the datagram.
+ * @param count Records in the datagram.
+ */
+static void client_sequence(struct client_entry *c, uint64_t seq, uint32_t count) {
+    struct client_info *info = client_info_of(c);
+    if (!info) return;
+    if (!info->seq_known) {
+        info->seq_known = 1;
+        info->seq_next = seq;
+    }
+    if (seq > info->seq_next) {
+        info->lost += seq - info->seq_next;
+    } else if (seq < info->seq_next) {
+        info->reordered++;
+        info->lost -= info->lost < count ? info->lost : count;
+    }
+    if (seq + count > info->seq_next) info->seq_next = seq + count;
+    info->seq_records += count;
+}
+
+/**
+ * @brief Updates the statistics of the client behind an address.
+ *
+ * Must be called with the mutex held.
+ *
+ * @param c Address entry of the sender.
+ * @param records Records in the datagram.
+ * @param drops Records in the datagram that could not be decoded.
+ * @param overflows Records the writer had no room for.
+ * @param bytes Size of the datagram.
+ */
+static void client_account(struct client_entry *c, uint32_t records, uint32_t drops, uint32_t overflows,
+                           size_t bytes) {
+    if (thread_ingest) stat_add(&thread_ingest->records, records);
+    struct client_info *info = client_info_of(c);
+    if (!info) return;
+    uint64_t now = realtime_ns();
+    info->msgs += records;
+    info->drops += drops;
+    info->overflows += overflows;
+    info->bytes += bytes;
+    info->last_seen = now / 1000000000ULL;
+    if (now - info->win_start >= RATE_WINDOW_NS) {
+        info->rate = info->win_start ? info->win_msgs * 1e9 / (now - info->win_start) : 0;
+        info->win_start = now;
+        info->win_msgs = 0;
+    }
+    info->win_msgs += records;
+}
+
+/**
+ * @brief Checks whether a client is addressed by a level command target.
+ *
+ * @param target "all", "group=<name>" or a client id.
+ */
+static int client_targeted(const struct client_info *info, const char *target) {
+    if (strcmp(target, "all") == 0) return 1;
+    if (strncmp(target, "group=", 6) == 0) return strcmp(info->group, target + 6) == 0;
+    return strcmp(info->id, target) == 0;
+}
+
+/**
+ * @brief Sends a new log level to every registered client a target selects.
+ *
+ * Collects the command addresses under the mutex, then sends the commands
+ * with sendmmsg() in batches of RECV_BATCH.
+ *
+ * @param target "all", "group=<name>" or a client id.
+ * @param level New log level.
+ * @return Number of clients the command was sent to.
+ */
+static int send_level(const char *target, int level) {
+    struct sockaddr_in *dests = (struct sockaddr_in *)malloc(MAX_CLIENT_IDS * sizeof(*dests));
+    if (!dests) {
+        perror("malloc");
+        return 0;
+    }
+    int n = 0;
+    pthread_mutex_lock(&mutex);
+    for (int i = 0; i < MAX_CLIENT_IDS; i++) {
+        const struct client_info *info = &client_ids[i];
+        if (info->used && info->ctrl_known && client_targeted(info, target)) dests[n++] = info->ctrl;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    char cmd[32];
+    struct iovec iov = { cmd, (size_t)snprintf(cmd, sizeof(cmd), "Set Log Level=%d", level) };
+    struct mmsghdr msgs[RECV_BATCH];
+    int sent = 0;
+    while (sent < n) {
+        int count = n - sent < RECV_BATCH ? n - sent : RECV_BATCH;
+        for (int i = 0; i < count; i++) {
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &dests[sent + i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(dests[0]);
+            msgs[i].msg_hdr.msg_iov = &iov;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int r = sendmmsg(sockfd, msgs, count, 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) perror("sendmmsg");
+            break;
+        }
+        sent += r;
+    }
+    free(dests);
+    return sent;
+}
+
+/**
+ * @brief Prints the client registry with per-client statistics.
+ */
+static void list_clients() {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&mutex);
+    printf("%-32s %-12s %-21s %10s %9s %12s %8s %8s %10s %7s %6s %6s\n", "ID", "GROUP", "COMMAND ADDR", "MSGS",
+           "MSGS/S", "BYTES", "DROPS", "OVERFLOW", "LOST", "LOSS%", "REORD", "SEEN");
+    for (int i = 0; i < MAX_CLIENT_IDS; i++) {
+        const struct client_info *info = &client_ids[i];
+        if (!info->used) continue;
+        char addr[32] = "-";
+        if (info->ctrl_known) {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &info->ctrl.sin_addr, ip, sizeof(ip));
+            snprintf(addr, sizeof(addr), "%s:%u", ip, ntohs(info->ctrl.sin_port));
+        }
+        // The rate of an idle client is not updated, report it as zero
+        double rate = info->last_seen && now - info->last_seen <= 2 ? info->rate : 0;
+        char seen[16] = "-";
+        if (info->last_seen) snprintf(seen, sizeof(seen), "%lds", (long)(now - info->last_seen));
+        // Loss rate over the records the client numbered
+        uint64_t expected = info->seq_records + info->lost;
+        double loss = expected ? 100.0 * info->lost / expected : 0;
+        printf("%-32s %-12s %-21s %10llu %9.0f %12llu %8llu %8llu %10llu %6.2f%% %6llu %6s\n", info->id, info->group,
+               addr, (unsigned long long)info->msgs, rate, (unsigned long long)info->bytes,
+               (unsigned long long)info->drops, (unsigned long long)info->overflows, (unsigned long long)info->lost, loss,
+               (unsigned long long)info->reordered, seen);
+    }
+    printf("%d clients\n", num_client_ids);
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Prints the count and latency percentiles of a histogram in
+ * microseconds.
+ */
+static void print_latency(const char *name, const struct log_histogram *src) {
+    static struct log_histogram h;  // Only used by the menu thread
+    memset(&h, 0, sizeof(h));
+    log_hist_merge(&h, src);
+    printf("  %-10s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, (unsigned long long)h.count,
+           h.count ? h.sum / 1e3 / h.count : 0.0, log_hist_percentile(&h, 0.5) / 1e3,
+           log_hist_percentile(&h, 0.99) / 1e3, log_hist_percentile(&h, 0.999) / 1e3, h.max / 1e3);
+}
+
+/**
+ * @brief Prints the counters of one ingest thread and adds them and its
+ * timings to total, unless total is NULL.
+ */
+static void print_ingest(const char *name, const struct ingest_stats *st, struct ingest_stats *total) {
+    uint64_t batches = __atomic_load_n(&st->batches, __ATOMIC_RELAXED);
+    uint64_t datagrams = __atomic_load_n(&st->datagrams, __ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_load_n(&st->bytes, __ATOMIC_RELAXED);
+    uint64_t records = __atomic_load_n(&st->records, __ATOMIC_RELAXED);
+    printf("%-10s %12llu %12llu %14llu %12llu %10.1f\n", name, (unsigned long long)batches,
+           (unsigned long long)datagrams, (unsigned long long)bytes, (unsigned long long)records,
+           batches ? (double)datagrams / batches : 0.0);
+    if (!total) return;
+    total->batches += batches;
+    total->datagrams += datagrams;
+    total->bytes += bytes;
+    total->records += records;
+    log_hist_merge(&total->lock_wait, &st->lock_wait);
+    log_hist_merge(&total->handle, &st->handle);
+}
+
+/**
+ * @brief Prints what the ingest threads and the writer have done and where
+ * their time went, per thread and in total.
+ */
+static void print_stats() {
+    static struct ingest_stats total;  // Only used by the menu thread
+    memset(&total, 0, sizeof(total));
+    printf("%-10s %12s %12s %14s %12s %10s\n", "THREAD", "BATCHES", "DATAGRAMS", "BYTES", "RECORDS", "PER BATCH");
+    for (int i = 0; i < num_workers; i++) {
+        char name[24];
+        snprintf(name, sizeof(name), "worker %d", i);
+        print_ingest(name, &workers[i].stats, &total);
+    }
+    if (shm_ring) print_ingest("shm", &shm_stats, &total);
+    print_ingest("total", &total, NULL);
+
+    printf("\nLatency (us) %10s %10s %10s %10s %10s %10s\n", "COUNT", "MEAN", "P50", "P99", "P99.9", "MAX");
+    print_latency("lock wait", &total.lock_wait);
+    print_latency("batch", &total.handle);
+
+    printf("\nWriter: %llu flushes, %llu bytes, %llu lines dropped, %llu bytes lost to write errors\n",
+           (unsigned long long)__atomic_load_n(&wstats.flushes, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&wstats.bytes, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&wstats.dropped, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&wstats.lost, __ATOMIC_RELAXED));
+    print_latency("flush", &wstats.flush);
+    print_latency("sync", &wstats.sync);
+}
+
+/**
+ * @brief Stores a call-site announcement in the sender's site table.
+ *
+ * Must be called with the mutex held.
+ */
+static void register_site(struct client_entry *c, const struct log_wire_record *rec) {
+    if (!c || rec->site_id >= MAX_SITE_ID) return;
+    if (rec->site_id >= c->num_sites) {
+        uint32_t n = c->num_sites ? c->num_sites : 64;
+        while (n <= rec->site_id) n *= 2;
+        struct site_entry *sites = (struct site_entry *)realloc(c->sites, n * sizeof(*sites));
+        if (!sites) return;
+        memset(sites + c->num_sites, 0, (n - c->num_sites) * sizeof(*sites));
+        c->sites = sites;
+        c->num_sites = n;
+    }
+
+    struct site_entry *site = &c->sites[rec->site_id];
+    free(site->file);
+    free(site->func);
+    free(site->fmt);
+    site->file = strndup(rec->file, rec->file_len);
+    site->func = strndup(rec->func, rec->func_len);
+    site->fmt = rec->type == LOG_WIRE_FMT_SITE ? strndup(rec->fmt, rec->fmt_len) : NULL;
+    site->line = rec->line;
+}
+
+/**
+ * @brief Fills in the call-site fields of a LOG_WIRE_REF or LOG_WIRE_ARGS record.
+ *
+ * Unknown IDs (announcement lost or not yet re-sent) render as "site#<id>".
+ * For LOG_WIRE_ARGS the message is formatted from the site's format string
+ * and the record's arguments. Must be called with the mutex held.
+ *
+ * @param c Sender of the record.
+ * @param rec Record to complete.
+ * @param scratch Buffer for the placeholder file name.
+ * @param msg Buffer of BUF_LEN bytes for the formatted message.
+ */
+static void resolve_site(const struct client_entry *c, struct log_wire_record *rec, char *scratch, char *msg) {
+    if (c && rec->site_id < c->num_sites && c->sites[rec->site_id].file) {
+        const struct site_entry *site = &c->sites[rec->site_id];
+        rec->file = site->file;
+        rec->file_len = strlen(site->file);
+        rec->func = site->func;
+        rec->func_len = strlen(site->func);
+        rec->line = site->line;
+        if (rec->type == LOG_WIRE_ARGS && site->fmt) {
+            struct log_arg args[LOG_MAX_ARGS];
+            int nargs = log_wire_decode_args(rec->args, rec->args_len, args, LOG_MAX_ARGS);
+            rec->msg = msg;
+            rec->msg_len = log_format_args(msg, BUF_LEN, site->fmt, strlen(site->fmt), args, nargs);
+        }
+    } else {
+        rec->file = scratch;
+        rec->file_len = sprintf(scratch, "site#%u", rec->site_id);
+        rec->func = "?";
+        rec->func_len = 1;
+        rec->line = 0;
+    }
+}
+
+/**
+ * @brief Releases the site tables of every client.
+ */
+static void free_clients() {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        free_sites(&clients[i]);
+        memset(&clients[i], 0, sizeof(clients[i]));
+    }
+    num_clients = 0;
+}
+
+/**
+ * @brief Handles one received datagram.
+ *
+ * Updates the client registry and appends the messages to the write buffer,
+ * each prefixed with the "[ip:port] " tag of the sender (see peer_name()
+ * for local senders) so that queries can filter by client. Must be called
+ * with the mutex held.
+ *
+ * @param buf Null-terminated datagram payload.
+ * @param len Length of buf.
+ * @param src_addr Address the datagram came from.
+ */
+static void handle_datagram(const char *buf, size_t len, const struct sockaddr_storage *src_addr) {
+    clients_now = time(NULL);
+    expire_clients();
+
+    // Hello messages register the client and are not logged; the ones from
+    // recv_socket come from an address that sends no records
+    if (strncmp(buf, "Client Hello", 12) == 0) {
+        client_hello(buf, strstr(buf, "send_socket") ? lookup_client(src_addr) : NULL, src_addr);
+        return;
+    }
+    struct client_entry *c = lookup_client(src_addr);
+    uint32_t records = 0, drops = 0, overflows = 0, numbered = 1;
+    size_t size = len;
+
+    // A sequence header numbers the records that follow it
+    struct log_wire_record rec;
+    if (len > 0 && (uint8_t)buf[0] == LOG_WIRE_MAGIC &&
+        log_wire_decode((const uint8_t *)buf, len, &rec) == LOG_WIRE_SEQ_LEN && rec.type == LOG_WIRE_SEQ) {
+        client_sequence(c, rec.seq, rec.count);
+        numbered = rec.count;
+        buf += LOG_WIRE_SEQ_LEN;
+        len -= LOG_WIRE_SEQ_LEN;
+    }
+
+    // Compressed datagrams are expanded in place of the payload; the buffer
+    // is shared, which the mutex allows
+    static char unpacked[DGRAM_LEN];
+    if (len > 0 && (uint8_t)buf[0] == LOG_WIRE_MAGIC &&
+        log_wire_decode((const uint8_t *)buf, len, &rec) > 0 && rec.type == LOG_WIRE_LZ) {
+        int n = rec.raw_len < sizeof(unpacked)
+                    ? log_lz_decompress(rec.packed, rec.packed_len, (uint8_t *)unpacked, rec.raw_len)
+                    : -1;
+        if (n < 0 || (uint32_t)n != rec.raw_len) {
+            client_account(c, 0, numbered, 0, size);  // Undecodable, drop its records
+            return;
+        }
+        unpacked[n] = '\0';
+        buf = unpacked;
+        len = n;
+    }
+
+    char tag[48], name[40];
+    peer_name(src_addr, name, sizeof(name));
+    int tag_len = snprintf(tag, sizeof(tag), "[%s] ", name);
+
+    // Binary datagrams hold one or more records back to back
+    if (len > 0 && (uint8_t)buf[0] == LOG_WIRE_MAGIC) {
+        const uint8_t *p = (const uint8_t *)buf;
+        const uint8_t *end = p + len;
+        char line[BUF_LEN * 2];
+        char scratch[32];
+        char msg[BUF_LEN];
+        while (p < end) {
+            int n = log_wire_decode(p, end - p, &rec);
+            if (n < 0) {
+                drops++;  // Malformed or truncated, drop the rest
+                break;
+            }
+            p += n;
+            if (rec.type == LOG_WIRE_SITE || rec.type == LOG_WIRE_FMT_SITE) {
+                register_site(c, &rec);
+                continue;
+            }
+            if (rec.type == LOG_WIRE_REF || rec.type == LOG_WIRE_ARGS) resolve_site(c, &rec, scratch, msg);
+            if (writer_append(tag, tag_len, line, render_record(line, sizeof(line), &rec)) == 0) records++;
+            else overflows++;
+        }
+        client_account(c, records, drops, overflows, size);
+        return;
+    }
+
+    // Queue the received messages for the log file; batched text datagrams
+    // hold several lines separated by newlines
+    const char *end = buf + len;
+    while (buf < end) {
+        const char *nl = (const char *)memchr(buf, '\n', end - buf);
+        const char *stop = nl ? nl : end;
+        if (stop > buf) {
+            if (writer_append(tag, tag_len, buf, stop - buf) == 0) records++;
+            else overflows++;
+        }
+        buf = stop + 1;
+    }
+    client_account(c, records, drops, overflows, size);
+}
+
+/**
+ * @brief Drains a socket with recvmmsg() until the kernel has nothing more queued.
+ *
+ * @param fd UDP or Unix datagram socket.
+ * @param bufs RECV_BATCH buffers of DGRAM_LEN bytes.
+ * @param stats Counters of the calling worker.
+ */
+static void drain_socket(int fd, char *bufs, struct ingest_stats *stats) {
+    struct sockaddr_storage src_addrs[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
+    struct mmsghdr msgs[RECV_BATCH];
+    for (;;) {
+        for (int i = 0; i < RECV_BATCH; i++) {
+            iov[i].iov_base = bufs + (size_t)i * DGRAM_LEN;
+            iov[i].iov_len = DGRAM_LEN - 1;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            memset(&src_addrs[i], 0, sizeof(src_addrs[i]));  // Unix addresses are compared whole
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &src_addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(src_addrs[i]);
+        }
+        int n = recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0) break;
+
+        uint64_t start = monotonic_ns();
+        pthread_mutex_lock(&mutex);
+        uint64_t locked = monotonic_ns();
+        for (int i = 0; i < n; i++) {
+            char *buf = bufs + (size_t)i * DGRAM_LEN;
+            buf[msgs[i].msg_len] = '\0'; // Ensure null-termination of received string
+            handle_datagram(buf, msgs[i].msg_len, &src_addrs[i]);
+            stat_add(&stats->bytes, msgs[i].msg_len);
+        }
+        pthread_mutex_unlock(&mutex);
+        log_hist_add(&stats->lock_wait, locked - start);
+        log_hist_add(&stats->handle, monotonic_ns() - locked);
+        stat_add(&stats->batches, 1);
+        stat_add(&stats->datagrams, n);
+        if (n < RECV_BATCH) break;
+    }
+}
 
 /**
  * @brief Thread function to receive log messages from clients.
  *
- * This function runs in a separate thread, continuously listening for log messages
- * over UDP. It logs the messages to a file and stores client information for
- * potential log level updates.
+ * Each worker runs this function in its own thread on its own socket; the
+ * kernel spreads datagrams across the SO_REUSEPORT sockets by flow, so every
+ * client is served by one worker and its records stay in order. All workers
+ * feed the shared writer under the mutex, which only copies lines into its
+ * front buffer; the disk thread does the I/O. The first worker also serves
+ * the Unix datagram socket of local clients.
+ *
+ * The worker sleeps in epoll_wait() until a socket is readable, then
+ * drains it with recvmmsg() in batches of up to RECV_BATCH datagrams. It
+ * queues the messages for the log file and stores client information for
+ * potential log level updates. Shutdown is signalled through wake_fd.
  *
- * @param arg Unused parameter.
+ * @param arg The recv_worker this thread serves.
  * @return NULL when the thread exits.
  */
 static void *receive_thread(void *arg) {
-    char buf[BUF_LEN];
-    struct sockaddr_in src_addr;
-    socklen_t addrlen = sizeof(src_addr);
+    struct recv_worker *worker = (struct recv_worker *)arg;
+    thread_ingest = &worker->stats;
+    char *bufs = (char *)malloc((size_t)RECV_BATCH * DGRAM_LEN);
+    if (!bufs) {
+        perror("malloc");
+        return NULL;
+    }
 
-    // Open log file in append mode to store incoming log messages
-    FILE *log_file = fopen(LOG_FILE, "a");
-    if (!log_file) {
-        perror("fopen");
+    // Wait on the log sockets and the shutdown eventfd
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        free(bufs);
         return NULL;
     }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = worker->fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, worker->fd, &ev);
+    ev.data.fd = wake_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+    if (worker == &workers[0] && local_fd >= 0) {
+        ev.data.fd = local_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, local_fd, &ev);
+    }
+
+    while (server_running) {
+        struct epoll_event events[3];
+        int ready = epoll_wait(epfd, events, 3, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.fd != wake_fd) drain_socket(events[i].data.fd, bufs, &worker->stats);
+        }
+    }
+
+    close(epfd);
+    free(bufs);
+    return NULL;
+}
+
+/**
+ * @brief Returns the slot of shm_ring for a position.
+ *
+ * Uses the ring geometry the server created, never the header's: the
+ * segment is writable by every local user.
+ *
+ * @param pos Ring position.
+ * @return The slot.
+ */
+static struct log_shm_slot *shm_slot(uint64_t pos) {
+    return (struct log_shm_slot *)((char *)(shm_ring + 1) +
+                                   (size_t)(pos & (LOG_SHM_SLOTS - 1)) * (sizeof(struct log_shm_slot) + LOG_SHM_SLOT_LEN));
+}
+
+/**
+ * @brief Creates the shared-memory ring local clients write to.
+ *
+ * A segment left by an earlier server is marked closed first, so clients
+ * still attached to it move to the new one.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int shm_ring_create() {
+    int fd = shm_open(LOG_SHM_NAME, O_RDWR, 0);
+    if (fd >= 0) {
+        struct log_shm_header *old = (struct log_shm_header *)mmap(NULL, sizeof(*old), PROT_READ | PROT_WRITE,
+                                                                   MAP_SHARED, fd, 0);
+        if (old != MAP_FAILED) {
+            __atomic_store_n(&old->closed, 1, __ATOMIC_RELEASE);
+            munmap(old, sizeof(*old));
+        }
+        close(fd);
+        shm_unlink(LOG_SHM_NAME);
+    }
+
+    size_t size = sizeof(struct log_shm_header) + (size_t)LOG_SHM_SLOTS * (sizeof(struct log_shm_slot) + LOG_SHM_SLOT_LEN);
+    fd = shm_open(LOG_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0666);
+    if (fd < 0) return -1;
+    fchmod(fd, 0666);  // Any local user may log, regardless of umask
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        shm_unlink(LOG_SHM_NAME);
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(LOG_SHM_NAME);
+        return -1;
+    }
+
+    struct log_shm_header *hdr = (struct log_shm_header *)map;
+    hdr->version = LOG_SHM_VERSION;
+    hdr->slots = LOG_SHM_SLOTS;
+    hdr->slot_len = LOG_SHM_SLOT_LEN;
+    shm_ring = hdr;
+    shm_size = size;
+    for (uint32_t i = 0; i < LOG_SHM_SLOTS; i++) shm_slot(i)->seq = i;
+    __atomic_store_n(&hdr->magic, LOG_SHM_MAGIC, __ATOMIC_RELEASE);  // Clients may attach from here on
+    return 0;
+}
 
-    // Set appropriate permissions for the log file
-    fchmod(fileno(log_file), 0666);
+/**
+ * @brief Hands abandoned ring slots back to the producers once their
+ * producer has exited.
+ *
+ * Scans the whole ring, so any number of slots can be abandoned at once.
+ *
+ * @return Number of slots still abandoned.
+ */
+static int shm_reclaim() {
+    int left = 0;
+    for (uint32_t i = 0; i < LOG_SHM_SLOTS; i++) {
+        struct log_shm_slot *slot = shm_slot(i);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & LOG_SHM_ABANDONED)) continue;
+        uint64_t pos = seq & ~LOG_SHM_ABANDONED;
+        pid_t pid = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+        if (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH) {
+            __atomic_store_n(&slot->pid, 0, __ATOMIC_RELAXED);
+            if (__atomic_compare_exchange_n(&slot->seq, &seq, pos + LOG_SHM_SLOTS, 0, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+                continue;
+        }
+        left++;
+    }
+    return left;
+}
 
+/**
+ * @brief Thread function consuming the shared-memory ring.
+ *
+ * Takes the datagrams local clients published, in order, and hands them
+ * to handle_datagram() under the mutex with a "shm:<pid>" sender. When
+ * the ring is empty it sleeps on the ring's futex until a producer wakes
+ * it. A slot a producer claimed but did not fill within SHM_STUCK_MS is
+ * marked abandoned and skipped (see LogProtocol.h); it is handed back by
+ * the producer if that was only slow, or here once the producer is gone.
+ *
+ * Positions and geometry are kept here, not read back from the header,
+ * which every local user can write.
+ *
+ * @param arg Unused.
+ * @return NULL when the thread exits.
+ */
+static void *shm_consume_thread(void *arg) {
+    struct log_shm_header *hdr = shm_ring;
+    char *buf = (char *)malloc(LOG_SHM_SLOT_LEN + 1);
+    if (!buf) {
+        perror("malloc");
+        return NULL;
+    }
+    struct timespec stuck_since = {0, 0};
+    int num_abandoned = 0;
+    uint64_t pos = 0;
+    thread_ingest = &shm_stats;
     while (server_running) {
-        memset(buf, 0, BUF_LEN);
-        int n = recvfrom(sockfd, buf, BUF_LEN - 1, 0, (struct sockaddr *)&src_addr, &addrlen);
-        if (n > 0) {
-            buf[n] = '\0'; // Ensure null-termination of received string
+        // Take up to RECV_BATCH published datagrams per mutex hold
+        struct log_shm_slot *slot = shm_slot(pos);
+        int taken = 0;
+        uint64_t start = monotonic_ns();
+        pthread_mutex_lock(&mutex);
+        uint64_t locked = monotonic_ns();
+        while (taken < RECV_BATCH && __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos + 1) {
+            uint32_t len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+            if (len > LOG_SHM_SLOT_LEN) len = 0;
+            struct sockaddr_storage src;
+            memset(&src, 0, sizeof(src));
+            struct sockaddr_un *un = (struct sockaddr_un *)&src;
+            un->sun_family = AF_UNIX;
+            snprintf(un->sun_path, sizeof(un->sun_path), "shm:%d", (int)slot->pid);
+            memcpy(buf, slot + 1, len);
+            buf[len] = '\0';
+            __atomic_store_n(&slot->pid, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->seq, pos + LOG_SHM_SLOTS, __ATOMIC_RELEASE);  // Hand the slot back
+            handle_datagram(buf, len, &src);
+            stat_add(&shm_stats.bytes, len);
+            pos++;
+            taken++;
+            slot = shm_slot(pos);
+        }
+        pthread_mutex_unlock(&mutex);
+        __atomic_store_n(&hdr->dequeue_pos, pos, __ATOMIC_RELAXED);
+        if (taken) {
+            log_hist_add(&shm_stats.lock_wait, locked - start);
+            log_hist_add(&shm_stats.handle, monotonic_ns() - locked);
+            stat_add(&shm_stats.batches, 1);
+            stat_add(&shm_stats.datagrams, taken);
+            stuck_since.tv_sec = 0;
+            continue;
+        }
 
-            pthread_mutex_lock(&mutex);
-            if (!client_known) {
-                // Store the first client that sends a log message
-                memcpy(&client_addr, &src_addr, sizeof(src_addr));
-                client_known = 1;
+        if (num_abandoned) num_abandoned = shm_reclaim();
+        if (__atomic_load_n(&hdr->enqueue_pos, __ATOMIC_ACQUIRE) != pos) {
+            // Claimed but not yet filled
+            if (stuck_since.tv_sec == 0) {
+                clock_gettime(CLOCK_MONOTONIC, &stuck_since);
+            } else if (elapsed_ms(&stuck_since) >= SHM_STUCK_MS) {
+                // Skip it; losing the race means the producer published meanwhile
+                uint64_t seq = pos;
+                if (__atomic_compare_exchange_n(&slot->seq, &seq, pos | LOG_SHM_ABANDONED, 0, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_ACQUIRE)) {
+                    pos++;
+                    __atomic_store_n(&hdr->dequeue_pos, pos, __ATOMIC_RELAXED);
+                    num_abandoned = shm_reclaim();
+                }
+                stuck_since.tv_sec = 0;
+            } else {
+                usleep(100);
+            }
+            continue;
+        }
+
+        // Empty: sleep until a producer bumps wake, or until abandoned
+        // slots are due for another look
+        uint32_t wake = __atomic_load_n(&hdr->wake, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&hdr->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == pos + 1 || !server_running) {
+            __atomic_store_n(&hdr->sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        struct timespec ts = { SHM_STUCK_MS / 1000, (SHM_STUCK_MS % 1000) * 1000000L };
+        syscall(SYS_futex, &hdr->wake, FUTEX_WAIT, wake, num_abandoned ? &ts : NULL, NULL, 0);
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Creates the Unix datagram socket local clients send to.
+ *
+ * Bound to the abstract name LOG_LOCAL_SOCKET, so nothing is left in the
+ * file system.
+ *
+ * @return The socket, or -1 on failure.
+ */
+static int open_local_socket() {
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path + 1, LOG_LOCAL_SOCKET);  // Leading NUL: abstract name
+    socklen_t len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(LOG_LOCAL_SOCKET);
+    if (bind(fd, (struct sockaddr *)&addr, len) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Packs a broken-down local time into a sortable time key.
+ *
+ * @return YYYYMMDDhhmmss * 1e9 + ns, so keys compare like the times.
+ */
+static uint64_t time_key(const struct tm *tm, long ns) {
+    uint64_t key = tm->tm_year + 1900;
+    key = key * 100 + tm->tm_mon + 1;
+    key = key * 100 + tm->tm_mday;
+    key = key * 100 + tm->tm_hour;
+    key = key * 100 + tm->tm_min;
+    key = key * 100 + tm->tm_sec;
+    return key * 1000000000ULL + ns;
+}
+
+/**
+ * @brief Parses an optional ".fraction" into nanoseconds.
+ *
+ * @param p Position of the dot; advanced past the digits.
+ */
+static long parse_fraction(const char **p) {
+    long ns = 0;
+    if (**p != '.') return 0;
+    (*p)++;
+    int digits = 0;
+    for (; **p >= '0' && **p <= '9'; (*p)++) {
+        if (digits++ < 9) ns = ns * 10 + (**p - '0');
+    }
+    for (; digits < 9; digits++) ns *= 10;
+    return ns;
+}
+
+/**
+ * @brief Parses a query time given as "YYYY-MM-DD HH:MM:SS[.fraction]".
+ *
+ * @param text Local time entered by the operator.
+ * @param upper Set for the end of a range; a time without fraction then
+ *              covers its whole second.
+ * @param key Time key of text.
+ * @param ns text in ns since the epoch.
+ * @return 0 on success, -1 when text is not a valid time.
+ */
+static int parse_query_time(const char *text, int upper, uint64_t *key, uint64_t *ns) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *p = strptime(text, "%Y-%m-%d %H:%M:%S", &tm);
+    if (!p) return -1;
+    long frac = *p == '.' ? parse_fraction(&p) : (upper ? 999999999 : 0);
+    *key = time_key(&tm, frac);
+    tm.tm_isdst = -1;
+    time_t sec = mktime(&tm);
+    if (sec < 0) return -1;
+    *ns = (uint64_t)sec * 1000000000ULL + frac;
+    return 0;
+}
+
+/**
+ * @brief Extracts the record time and level of a stored line.
+ *
+ * Lines look like "[ip:port] Thu Oct 16 10:00:00.123456 2026 DEBUG ...";
+ * the fraction is only present when the client sends one.
+ *
+ * @param line NUL-terminated line.
+ * @param key Time key of the record.
+ * @param level Level of the record, or -1 when it has none.
+ * @return 0 on success, -1 when the line carries no timestamp.
+ */
+static int parse_line(const char *line, uint64_t *key, int *level) {
+    static const char *level_str[] = {"DEBUG", "WARNING", "ERROR", "CRITICAL"};
+    const char *p = line;
+    if (*p == '[') {
+        p = strchr(p, ']');
+        if (!p) return -1;
+        p++;
+    }
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    p = strptime(p, " %a %b %e %H:%M:%S", &tm);
+    if (!p) return -1;
+    long ns = parse_fraction(&p);
+    char *end;
+    long year = strtol(p, &end, 10);
+    if (end == p) return -1;
+    tm.tm_year = year - 1900;
+    *key = time_key(&tm, ns);
+
+    *level = -1;
+    p = end;
+    while (*p == ' ') p++;
+    for (int i = 0; i < 4; i++) {
+        size_t n = strlen(level_str[i]);
+        if (strncmp(p, level_str[i], n) == 0 && (p[n] == ' ' || p[n] == '\0')) *level = i;
+    }
+    return 0;
+}
+
+/**
+ * @brief Narrows a data range to the part that can hold a time range.
+ *
+ * Loads the sparse index and binary-searches it for the last entry received
+ * before from_ns and the first entry received after to_ns, both widened by
+ * QUERY_SLACK_NS since records carry client time but the index receive time.
+ * Without an index the range is left as it is.
+ *
+ * @param idx_path Index file of the data.
+ * @param q Query with the time range.
+ * @param start Start of the data range, moved forward.
+ * @param end End of the data range, moved back.
+ */
+static void index_narrow(const char *idx_path, const struct log_query *q, uint64_t *start, uint64_t *end) {
+    int fd = open(idx_path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    struct index_entry *idx = NULL;
+    size_t n = 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*idx)) {
+        n = st.st_size / sizeof(*idx);
+        idx = (struct index_entry *)malloc(n * sizeof(*idx));
+        if (!idx || pread(fd, idx, n * sizeof(*idx), 0) != (ssize_t)(n * sizeof(*idx))) n = 0;
+    }
+    close(fd);
+
+    if (n && q->from_ns > QUERY_SLACK_NS) {
+        uint64_t from = q->from_ns - QUERY_SLACK_NS;
+        size_t lo = 0, hi = n;  // First entry with ns >= from
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (idx[mid].ns < from) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo > 0 && idx[lo - 1].offset > *start) *start = idx[lo - 1].offset;
+    }
+    if (n && q->to_ns) {
+        uint64_t to = q->to_ns + QUERY_SLACK_NS;
+        size_t lo = 0, hi = n;  // First entry with ns > to
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (idx[mid].ns <= to) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < n && idx[lo].offset < *end) *end = idx[lo].offset;
+    }
+    free(idx);
+}
+
+/**
+ * @brief Checks a stored line against the query filters.
+ */
+static int query_match(const char *line, const struct log_query *q) {
+    if (q->contains[0] && !strstr(line, q->contains)) return 0;
+    if (q->client[0]) {
+        const char *close_tag = line[0] == '[' ? strchr(line, ']') : NULL;
+        const char *hit = strstr(line, q->client);
+        if (!close_tag || !hit || hit > close_tag) return 0;
+    }
+    if (q->from_key || q->to_key || q->min_level >= 0) {
+        uint64_t key;
+        int level;
+        if (parse_line(line, &key, &level) < 0) return q->min_level < 0 && !q->from_key && !q->to_key;
+        if (key < q->from_key || (q->to_key && key > q->to_key)) return 0;
+        if (level < q->min_level) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Prints the matching lines of one data range of a file.
+ *
+ * Reads with pread() in large chunks; the range must start on a line
+ * boundary, which every index entry does.
+ *
+ * @param fd File holding the lines.
+ * @param base File offset of data offset 0.
+ * @param start First data offset to read.
+ * @param end End of the data to read.
+ * @param q Query filters.
+ * @param out Destination stream.
+ * @return Number of matching lines.
+ */
+static long query_range(int fd, uint64_t base, uint64_t start, uint64_t end, const struct log_query *q, FILE *out) {
+    size_t cap = 1 << 20;
+    char *buf = (char *)malloc(cap + 1);
+    if (!buf) {
+        perror("malloc");
+        return 0;
+    }
+
+    long matches = 0;
+    size_t have = 0;
+    uint64_t off = start;
+    while (off < end) {
+        size_t want = end - off < cap - have ? end - off : cap - have;
+        ssize_t n = pread(fd, buf + have, want, base + off);
+        if (n <= 0) {
+            if (n < 0) perror("pread");
+            break;
+        }
+        off += n;
+        have += n;
+
+        char *p = buf;
+        char *stop = buf + have;
+        char *nl;
+        while ((nl = (char *)memchr(p, '\n', stop - p)) != NULL) {
+            *nl = '\0';
+            if (query_match(p, q)) {
+                fprintf(out, "%s\n", p);
+                matches++;
+            }
+            p = nl + 1;
+        }
+        if (p == buf && have == cap) {
+            // Line longer than the buffer, check the part that fits
+            buf[have] = '\0';
+            if (query_match(buf, q)) {
+                fprintf(out, "%s\n", buf);
+                matches++;
             }
+            p = stop;
+        }
+        have = stop - p;
+        memmove(buf, p, have);
+    }
+    if (have) {
+        // Last line without a newline
+        buf[have] = '\0';
+        if (query_match(buf, q)) {
+            fprintf(out, "%s\n", buf);
+            matches++;
+        }
+    }
+    free(buf);
+    return matches;
+}
 
-            // If the client sends a "hello" message, store its receiving port
-            if (strncmp(buf, "Client Hello", 12) == 0) {
-                memcpy(&recv_client_addr, &src_addr, sizeof(src_addr));
-                recv_client_known = 1;
+/**
+ * @brief Prints the matching lines of one data range of a compressed
+ * segment, decompressing only the blocks the range overlaps.
+ *
+ * @param fd Compressed segment file.
+ * @param zhdr Its header.
+ * @param start First data offset to read, on a line boundary.
+ * @param end End of the data to read.
+ * @param q Query filters.
+ * @param out Destination stream.
+ * @return Number of matching lines.
+ */
+static long query_zsegment(int fd, const struct zsegment_header *zhdr, uint64_t start, uint64_t end,
+                           const struct log_query *q, FILE *out) {
+    size_t table_len = zhdr->blocks * sizeof(struct zsegment_block);
+    struct zsegment_block *table = (struct zsegment_block *)malloc(table_len ? table_len : 1);
+    uint8_t *packed = (uint8_t *)malloc(ZBLOCK_LEN);
+    char *raw = (char *)malloc(ZBLOCK_LEN + 1);
+    long matches = 0;
+    if (!table || !packed || !raw ||
+        pread(fd, table, table_len, zhdr->table_offset) != (ssize_t)table_len) {
+        fprintf(stderr, "Unreadable compressed segment %llu\n", (unsigned long long)zhdr->seg.segment_id);
+        free(table);
+        free(packed);
+        free(raw);
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < zhdr->blocks; i++) {
+        const struct zsegment_block *b = &table[i];
+        if (b->data_offset + b->raw_len <= start || b->data_offset >= end) continue;
+        if (b->raw_len > ZBLOCK_LEN || b->packed_len > b->raw_len ||
+            pread(fd, b->packed_len < b->raw_len ? (char *)packed : raw, b->packed_len, b->file_offset) !=
+                (ssize_t)b->packed_len ||
+            (b->packed_len < b->raw_len &&
+             log_lz_decompress(packed, b->packed_len, (uint8_t *)raw, b->raw_len) != (int)b->raw_len)) {
+            fprintf(stderr, "Corrupt block in compressed segment %llu\n", (unsigned long long)zhdr->seg.segment_id);
+            continue;
+        }
+
+        // Lines inside the requested range; blocks end on line boundaries
+        char *p = raw + (start > b->data_offset ? start - b->data_offset : 0);
+        char *stop = raw + (end < b->data_offset + b->raw_len ? end - b->data_offset : b->raw_len);
+        while (p < stop) {
+            char *nl = (char *)memchr(p, '\n', stop - p);
+            char *eol = nl ? nl : stop;
+            *eol = '\0';
+            if (query_match(p, q)) {
+                fprintf(out, "%s\n", p);
+                matches++;
             }
+            p = eol + 1;
+        }
+    }
+    free(table);
+    free(packed);
+    free(raw);
+    return matches;
+}
 
-            // Log the received message to the file
-            fprintf(log_file, "%s\n", buf);
-            fflush(log_file);
-            pthread_mutex_unlock(&mutex);
-        } else {
-            sleep(1); // Prevent high CPU usage when no data is received
+/**
+ * @brief Prints the stored lines that match a query.
+ *
+ * Uses the segment headers to skip whole segments outside the time range
+ * and the sparse index to seek inside a file, so only the region that can
+ * hold matches is read. Reads through the files rather than the writer's
+ * mapping, so the locks are only taken to drain pending lines.
+ *
+ * @param q Query filters.
+ * @param out Destination stream.
+ * @return Number of matching lines.
+ */
+static long query_log(const struct log_query *q, FILE *out) {
+    // Make sure buffered lines are visible in the files
+    pthread_mutex_lock(&mutex);
+    writer_drain();
+    pthread_mutex_unlock(&mutex);
+    pthread_mutex_lock(&disk_mutex);
+    uint32_t first_id = segments.first_id, end_id = segments.next_id;
+    pthread_mutex_unlock(&disk_mutex);
+
+    uint64_t from = q->from_ns > QUERY_SLACK_NS ? q->from_ns - QUERY_SLACK_NS : 0;
+    uint64_t to = q->to_ns ? q->to_ns + QUERY_SLACK_NS : UINT64_MAX;
+    char path[256];
+    long matches = 0;
+
+    if (!segments.enabled) {
+        int fd = open(LOG_FILE, O_RDONLY);
+        if (fd < 0) {
+            perror("open");
+            return 0;
         }
+        struct stat st;
+        uint64_t start = 0, end = fstat(fd, &st) == 0 ? st.st_size : 0;
+        snprintf(path, sizeof(path), "%s.idx", LOG_FILE);
+        index_narrow(path, q, &start, &end);
+        matches = query_range(fd, 0, start, end, q, out);
+        close(fd);
+        return matches;
     }
 
-    fclose(log_file);
-    return NULL;
+    for (uint32_t id = first_id; id < end_id; id++) {
+        segment_path(id, path, sizeof(path));
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            segment_path(id, path, sizeof(path), "segz");
+            fd = open(path, O_RDONLY);
+        }
+        if (fd < 0) continue;  // Removed by retention meanwhile
+
+        struct zsegment_header zhdr;  // Also reads a plain segment header
+        const struct segment_header &hdr = zhdr.seg;
+        ssize_t got = pread(fd, &zhdr, sizeof(zhdr), 0);
+        int plain = got >= (ssize_t)sizeof(hdr) && memcmp(hdr.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) == 0;
+        int packed = got == (ssize_t)sizeof(zhdr) && memcmp(hdr.magic, SEGMENTZ_MAGIC, sizeof(SEGMENTZ_MAGIC)) == 0;
+        if ((plain || packed) && hdr.records && hdr.first_ns <= to && hdr.last_ns >= from) {
+            uint64_t start = 0, end = hdr.data_len;
+            segment_path(id, path, sizeof(path), "idx");
+            index_narrow(path, q, &start, &end);
+            if (plain) matches += query_range(fd, SEGMENT_HEADER_LEN, start, end, q, out);
+            else matches += query_zsegment(fd, &zhdr, start, end, q, out);
+        }
+        close(fd);
+    }
+    return matches;
+}
+
+/**
+ * @brief Reads one line of operator input without its newline.
+ */
+static void read_input(const char *prompt, char *buf, size_t len) {
+    printf("%s", prompt);
+    fflush(stdout);
+    if (!fgets(buf, len, stdin)) buf[0] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
 }
 
 /**
- * @brief Dumps the contents of the log file to the console.
+ * @brief Asks the operator for query filters and prints the matching lines.
  *
- * This function reads the log file and prints its contents to the screen.
- * If the log file cannot be opened, an error message is displayed.
+ * Empty answers leave a filter unset.
  */
-static void dump_log_file() {
-    FILE *log_file = fopen(LOG_FILE, "r");
-    if (!log_file) {
-        printf("Failed to open log file for reading\n");
+static void query_menu() {
+    struct log_query q;
+    memset(&q, 0, sizeof(q));
+    q.min_level = -1;
+    char input[256];
+
+    read_input("From (YYYY-MM-DD HH:MM:SS[.frac], empty for the start): ", input, sizeof(input));
+    if (input[0] && parse_query_time(input, 0, &q.from_key, &q.from_ns) < 0) {
+        printf("Invalid time\n");
         return;
     }
-
-    char line[BUF_LEN];
-    while (fgets(line, BUF_LEN, log_file)) {
-        printf("%s", line);
+    read_input("To (YYYY-MM-DD HH:MM:SS[.frac], empty for the end): ", input, sizeof(input));
+    if (input[0] && parse_query_time(input, 1, &q.to_key, &q.to_ns) < 0) {
+        printf("Invalid time\n");
+        return;
     }
+    read_input("Minimum level (0=DEBUG, 1=WARNING, 2=ERROR, 3=CRITICAL, empty for all): ", input, sizeof(input));
+    if (input[0]) q.min_level = atoi(input);
+    read_input("Client (ip:port or part of it, empty for all): ", q.client, sizeof(q.client));
+    read_input("Containing (empty for any text): ", q.contains, sizeof(q.contains));
 
-    fclose(log_file);
-    printf("\nPress any key to continue: ");
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long matches = query_log(&q, stdout);
+    printf("\n%ld matching lines in %ld ms\n", matches, elapsed_ms(&t0));
+    printf("Press any key to continue: ");
     getchar();
 }
 
 /**
- * @brief Main function to start the UDP logging server.
+ * @brief Creates a non-blocking UDP socket bound to SERVER_PORT.
  *
- * The function initializes the UDP socket, binds it to the server port,
- * starts the receiving thread, and provides a menu for log management.
+ * With more than one worker, SO_REUSEPORT lets every receive worker bind
+ * its own socket to the port. It is left off for a single worker: with it
+ * set, any process of the same user could bind the port as well and take a
+ * share of the clients' datagrams.
  *
- * @return 0 on successful execution.
+ * @return The socket, or -1 on failure.
  */
-int main() {
+static int open_server_socket() {
     // Create a UDP socket
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
         perror("socket");
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+
+    int on = 1;
+    if (num_workers > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("setsockopt");
+        close(fd);
+        return -1;
     }
 
     // Set socket to non-blocking mode
-    int flags = fcntl(sockfd, F_GETFL, 0);
-    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
     // Set up the server address struct
     struct sockaddr_in server_addr;
@@ -150,13 +2370,119 @@ int main() {
     server_addr.sin_port = htons(SERVER_PORT);
 
     // Bind the socket to the specified port
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Main function to start the UDP logging server.
+ *
+ * The function initializes the UDP socket, binds it to the server port,
+ * starts the receiving thread, and provides a menu for log management.
+ *
+ * Options:
+ * - -d none|periodic|batch  Durability of the log file (default none).
+ * - -b bytes                Group-commit buffer size (default WRITE_BUF_LEN).
+ * - -t ms                   Longest time a line stays buffered (default FLUSH_INTERVAL_MS).
+ * - -w count                Number of receive workers (default 1, at most MAX_WORKERS).
+ *                           More than one sets SO_REUSEPORT, so other processes
+ *                           of the same user can also bind SERVER_PORT.
+ * - -m MB                   Store logs in pre-allocated, memory-mapped segments of
+ *                           this size under SEGMENT_DIR instead of LOG_FILE.
+ * - -r count                Keep at most this many segments (default 0 = all).
+ * - -L                      Only accept records over UDP, no Unix socket or
+ *                           shared-memory ring for local clients.
+ *
+ * @return 0 on successful execution.
+ */
+int main(int argc, char *argv[]) {
+    int opt;
+    int local = 1;
+    while ((opt = getopt(argc, argv, "d:b:t:w:m:r:zL")) != -1) {
+        if (opt == 'd' && strcmp(optarg, "none") == 0) {
+            writer.durability = DURABILITY_NONE;
+        } else if (opt == 'd' && strcmp(optarg, "periodic") == 0) {
+            writer.durability = DURABILITY_PERIODIC;
+        } else if (opt == 'd' && strcmp(optarg, "batch") == 0) {
+            writer.durability = DURABILITY_BATCH;
+        } else if (opt == 'b' && atol(optarg) > 0) {
+            writer.cap = atol(optarg);
+        } else if (opt == 't' && atoi(optarg) >= 0) {
+            writer.flush_ms = atoi(optarg);
+        } else if (opt == 'w' && atoi(optarg) > 0 && atoi(optarg) <= MAX_WORKERS) {
+            num_workers = atoi(optarg);
+        } else if (opt == 'm' && atol(optarg) > 0) {
+            segments.enabled = 1;
+            segments.size = (size_t)atol(optarg) << 20;
+        } else if (opt == 'r' && atoi(optarg) >= 0) {
+            segments.retain = atoi(optarg);
+        } else if (opt == 'z') {
+            compress_segments = 1;
+        } else if (opt == 'L') {
+            local = 0;
+        } else {
+            fprintf(stderr, "Usage: %s [-d none|periodic|batch] [-b bytes] [-t ms] [-w workers] [-m segment_mb] [-r segments] [-z] [-L]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (compress_segments && !segments.enabled) {
+        fprintf(stderr, "-z compresses sealed segments and needs -m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A full write buffer must always fit in an empty segment
+    if (segments.enabled && segments.size < SEGMENT_HEADER_LEN + writer.cap) {
+        segments.size = SEGMENT_HEADER_LEN + writer.cap;
+    }
+
+    // Create one socket per receive worker, all bound to SERVER_PORT
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].fd = open_server_socket();
+        if (workers[i].fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    sockfd = workers[0].fd;
+
+    // Local transports; UDP keeps working if they cannot be set up
+    if (local) {
+        local_fd = open_local_socket();
+        if (local_fd < 0) perror("Unix socket");
+        if (shm_ring_create() < 0) perror("Shared-memory ring");
+    }
+
+    // Open the log file through the group-commit writer
+    if (writer_open(LOG_FILE) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Create the eventfd used to wake the receive workers at shutdown
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        perror("eventfd");
         exit(EXIT_FAILURE);
     }
 
-    // Start the receive thread to handle incoming log messages
-    if (pthread_create(&recv_thread, NULL, receive_thread, NULL) != 0) {
+    // Start the receive workers to handle incoming log messages
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, receive_thread, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (shm_ring && pthread_create(&shm_thread, NULL, shm_consume_thread, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&disk_thread, NULL, disk_thread_main, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    if (compress_segments && pthread_create(&compact_thread, NULL, compact_thread_main, NULL) != 0) {
         perror("pthread_create");
         exit(EXIT_FAILURE);
     }
@@ -168,45 +2494,79 @@ int main() {
     while (server_running) {
         printf("\nServer Menu:\n");
         printf("1. Set the log level\n");
-        printf("2. Dump the log file here\n");
+        printf("2. Query the log\n");
+        printf("3. List clients\n");
+        printf("4. Show statistics\n");
         printf("0. Shut down\n");
         printf("Enter choice: ");
         scanf("%d", &choice);
         getchar(); // Consume newline character after integer input
 
         if (choice == 1) {
-            if (!recv_client_known) {
-                printf("No client receive port known yet. Waiting for hello message.\n");
+            read_input("Target (all, group=<name> or a client id): ", buf, BUF_LEN);
+            printf("Enter log level (0=DEBUG, 1=WARNING, 2=ERROR, 3=CRITICAL): ");
+            int level;
+            scanf("%d", &level);
+            getchar();
+
+            // Validate log level input
+            if (level >= 0 && level <= 3) {
+                int sent = send_level(buf[0] ? buf : "all", level);
+                printf("Sent log level %d to %d clients\n", level, sent);
             } else {
-                printf("Enter log level (0=DEBUG, 1=WARNING, 2=ERROR, 3=CRITICAL): ");
-                int level;
-                scanf("%d", &level);
-                getchar();
-
-                // Validate log level input
-                if (level >= 0 && level <= 3) {
-                    snprintf(buf, BUF_LEN, "Set Log Level=%d", level);
-                    sendto(sockfd, buf, strlen(buf), 0, (struct sockaddr *)&recv_client_addr, sizeof(recv_client_addr));
-                    printf("Sent log level %d to client\n", level);
-                } else {
-                    printf("Invalid level\n");
-                }
+                printf("Invalid level\n");
             }
         } else if (choice == 2) {
-            // Display the contents of the log file
-            dump_log_file();
+            // Show the stored lines matching the operator's filters
+            query_menu();
+        } else if (choice == 3) {
+            list_clients();
+        } else if (choice == 4) {
+            print_stats();
         } else if (choice == 0) {
-            // Exit the server
+            // Exit the server and wake the receive workers
             server_running = 0;
+            uint64_t one = 1;
+            if (write(wake_fd, &one, sizeof(one)) < 0) perror("write");
+            if (shm_ring) {
+                __atomic_fetch_add(&shm_ring->wake, 1, __ATOMIC_SEQ_CST);
+                syscall(SYS_futex, &shm_ring->wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+            }
         } else {
             printf("Invalid choice\n");
         }
     }
 
-    // Wait for the receiving thread to exit before shutting down
-    pthread_join(recv_thread, NULL);
-    close(sockfd);
+    // Wait for the receive workers to exit before shutting down
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].fd);
+    }
+    if (shm_ring) {
+        pthread_join(shm_thread, NULL);
+        __atomic_store_n(&shm_ring->closed, 1, __ATOMIC_RELEASE);  // Clients stop writing to it
+        munmap(shm_ring, shm_size);
+        shm_unlink(LOG_SHM_NAME);
+    }
+
+    // Let the disk thread write what the workers queued, then stop it
+    pthread_mutex_lock(&mutex);
+    writer.stop = 1;
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(disk_thread, NULL);
+    if (compress_segments) {
+        pthread_mutex_lock(&disk_mutex);
+        pthread_cond_signal(&compact_cond);
+        pthread_mutex_unlock(&disk_mutex);
+        pthread_join(compact_thread, NULL);
+    }
+    if (local_fd >= 0) close(local_fd);
+    close(wake_fd);
+    writer_close();
+    free_clients();
     pthread_mutex_destroy(&mutex);
+    pthread_mutex_destroy(&disk_mutex);
 
     printf("Server shut down\n");
     return 0;
@@ -1,59 +1,1630 @@
 #include "Logger.h"
+#include "LogProtocol.h"
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <atomic>
+#include <new>
 
 // Define configurable buffer length, server and client port, and IP addresses
 #define BUF_LEN 1024                  // Buffer size for message handling
 #define SERVER_IP "127.0.0.1"         // Server IP address for communication
 #define SERVER_PORT 54321             // Server port for receiving messages
 #define CLIENT_PORT 54322             // Client port for receiving commands from server
+#define RING_SLOTS 256                // Records per thread ring buffer (power of two)
+#define FLUSH_IDLE_US 1000            // Flusher sleep when every ring is empty
+#define BATCH_MAX 64                  // Upper bound on datagrams per sendmmsg() call
+#define MAX_DGRAM 65507               // Largest UDP payload
+#define SITE_TABLE_SIZE 4096          // Call-site registry slots (power of two)
+#define MAX_SITES (SITE_TABLE_SIZE / 2) // Registry is kept at most half full
+#define SITE_REANNOUNCE_SEC 10        // Re-send a call-site announcement this often
+#define HELLO_INTERVAL_SEC 30         // Re-send the hello messages this often
+#define OVERFLOW_TIMEOUT_US 10000     // Default wait of LOG_OVERFLOW_BLOCK
+#define RING_WAIT_US 50               // Poll interval of a producer waiting for ring space
+#define DROP_REPORT_SEC 10            // Send a summary of dropped records this often
+#define CRASH_SLOT_SIZE (sizeof(log_crash_slot) + BUF_LEN)  // Crash ring slot, header included
+#define MAX_SITE_LIMITS 64            // Per-site overrides SetLogSiteRateLimit() keeps
+#define MIN_RECORD_LEN 64             // Smallest limit SetLogMaxRecord() accepts
+#define TRUNC_MARKER "...[truncated]" // Ends a text record cut at the size limit
+#define FILTERED_BATCH 64             // Filtered calls a thread counts before publishing them (power of two)
 
 // Static variables for sockets and thread handling
 static int send_socket = -1;       // Socket for sending logs to the server
 static int recv_socket = -1;       // Socket for receiving commands from the server
-static struct sockaddr_in server_addr;      // Server address for sending logs
-static LOG_LEVEL log_filter = DEBUG;         // Log level filter (default: DEBUG)
+static struct sockaddr_in server_addr;      // Server address for hellos and commands
+static struct sockaddr_storage data_addr;   // Where send_socket sends records
+static socklen_t data_addrlen = 0;
+std::atomic<int> log_filter(DEBUG);          // Log level filter (default: DEBUG), read lock-free
 static pthread_t recv_thread;       // Thread to handle receiving commands
 static int server_running = 1;      // Flag to keep the server running
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for thread safety
+static LOG_MODE log_mode = LOG_MODE_SYNC;  // Delivery mode selected by SetLogMode()
+static std::atomic<int> time_precision(LOG_TIME_USEC);  // Sub-second digits in timestamps
+static std::atomic<int> max_record(BUF_LEN);  // Text record limit incl. terminator, see SetLogMaxRecord()
+static LOG_FORMAT log_format = LOG_FORMAT_TEXT;  // Wire format selected by SetLogFormat()
+static char client_id[64];          // Name the server registers this process under
+static char client_group[32];       // Group for level commands aimed at several clients
+static LOG_TRANSPORT log_transport = LOG_TRANSPORT_UDP;  // Selected by SetLogTransport()
+static std::atomic<log_shm_header *> shm_ring(NULL);  // Server's ring for LOG_TRANSPORT_SHM
+
+// Delivery counters, see GetLogCounters()
+static std::atomic<uint64_t> send_seq(0);        // Sequence number of the next record sent
+static std::atomic<uint64_t> sent_records(0);    // Records handed to the kernel
+static std::atomic<uint64_t> drop_eagain(0);     // Records refused with EAGAIN (socket buffer full)
+static std::atomic<uint64_t> drop_enobufs(0);    // Records refused with ENOBUFS
+static std::atomic<uint64_t> drop_error(0);      // Records refused with any other error
+static std::atomic<uint64_t> drop_ring(0);       // Records dropped because a ring was full
+static std::atomic<uint64_t> drop_oldest(0);     // Queued records discarded for newer ones
+static std::atomic<uint64_t> drop_sampled(0);    // Records skipped by sampling
+static std::atomic<uint64_t> drop_timeout(0);    // Records dropped after a full wait
+static std::atomic<uint64_t> block_waits(0);     // Times a sender waited for room
+static std::atomic<uint64_t> packed_in(0);       // Payload bytes offered to compression
+static std::atomic<uint64_t> packed_out(0);      // The same payloads as sent
+static std::atomic<uint64_t> rate_suppressed(0); // Records held back by per-site rate limits
+static std::atomic<uint64_t> coalesced(0);       // Repeated records folded into summaries
+static std::atomic<uint64_t> truncated(0);       // Text records cut at the size limit
+
+// Overflow handling, see SetLogOverflow()
+static std::atomic<int> overflow_policy(LOG_OVERFLOW_DROP_NEWEST);  // Read lock-free by every thread
+static std::atomic<int> overflow_timeout_us(OVERFLOW_TIMEOUT_US);
+static std::atomic<int> overflow_sample_n(10);
+static thread_local int thread_overflow = -1;    // Per-thread override, -1 = none
+static thread_local unsigned sample_count = 0;   // Records seen by sampling on this thread
+
+// Latency histograms of one thread, allocated once SetLogStats(1) is on
+struct thread_timings {
+    log_histogram build;      // Building one record
+    log_histogram lock_wait;  // Waiting for log_mutex
+    log_histogram send;       // One transport send call
+    log_histogram call;       // A record from the call to queued or sent
+};
+
+// Hot-path counters of one thread, see GetLogStats(). Only the owning
+// thread writes them, on a cache line of their own.
+struct alignas(64) thread_stats {
+    uint64_t calls;           // Records past the level filter
+    uint64_t bytes;           // Bytes of records built
+    uint64_t datagrams;       // Datagrams handed to the transport
+    thread_timings *timings;  // NULL until the thread times something
+    thread_stats *next;       // Next in stats_list
+};
+
+static std::atomic<int> stats_timing(0);  // Timings enabled by SetLogStats()
+static std::atomic<uint64_t> stats_filtered(0);  // Filtered calls, published in steps of FILTERED_BATCH
+static thread_local uint64_t local_filtered = 0; // Filtered calls of this thread, see count_filtered()
+static thread_stats *stats_list = NULL;   // Stats of live threads
+static thread_stats stats_retired;        // Stats of exited threads, summed
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards stats_list and stats_retired
+
+/**
+ * Adds the counters and timings of src into dst, giving dst histograms
+ * when src has some.
+ */
+static void merge_stats(thread_stats *dst, const thread_stats *src) {
+    dst->calls += __atomic_load_n(&src->calls, __ATOMIC_RELAXED);
+    dst->bytes += __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+    dst->datagrams += __atomic_load_n(&src->datagrams, __ATOMIC_RELAXED);
+    const thread_timings *t = __atomic_load_n(&src->timings, __ATOMIC_ACQUIRE);
+    if (!t) return;
+    if (!dst->timings) dst->timings = new (std::nothrow) thread_timings();
+    if (!dst->timings) return;
+    log_hist_merge(&dst->timings->build, &t->build);
+    log_hist_merge(&dst->timings->lock_wait, &t->lock_wait);
+    log_hist_merge(&dst->timings->send, &t->send);
+    log_hist_merge(&dst->timings->call, &t->call);
+}
+
+/**
+ * Folds the stats of an exiting thread into stats_retired and frees them.
+ */
+static void retire_stats(thread_stats *stats) {
+    pthread_mutex_lock(&stats_mutex);
+    merge_stats(&stats_retired, stats);
+    for (thread_stats **p = &stats_list; *p; p = &(*p)->next) {
+        if (*p == stats) {
+            *p = stats->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    delete stats->timings;
+    delete stats;
+}
+
+struct call_site;
+
+// Run of identical records of one thread, see SetLogCoalescing(). The owner
+// compares and counts repeats without locking; opening a run, replacing the
+// held record and summarizing a run take lock, which the receive thread and
+// ExitLog() also take to summarize the runs of other threads.
+struct coalesce_state {
+    pthread_mutex_t lock;
+    std::atomic<uint32_t> repeats;   // Identical records held back in the current run
+    std::atomic<uint64_t> first_ns;  // Wall-clock times of the first and last of them
+    std::atomic<uint64_t> last_ns;
+    call_site *site;                 // Interned site of the record the run repeats; owner writes under lock
+    int key_len;                     // Message text, or the encoded arguments of a format
+    char key[BUF_LEN];
+    coalesce_state *next;            // Next in coalesce_list
+};
+
+static std::atomic<int> coalesce_ms(0);       // Run timeout, 0 = coalescing off
+static coalesce_state *coalesce_list = NULL;  // States of live threads
+static pthread_mutex_t coalesce_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards coalesce_list
+
+static void coalesce_flush(coalesce_state *cs);
+
+/**
+ * Summarizes the run of an exiting thread, then unregisters and frees its state.
+ */
+static void retire_coalesce(coalesce_state *cs) {
+    pthread_mutex_lock(&coalesce_mutex);
+    for (coalesce_state **p = &coalesce_list; *p; p = &(*p)->next) {
+        if (*p == cs) {
+            *p = cs->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&coalesce_mutex);
+    coalesce_flush(cs);
+    pthread_mutex_destroy(&cs->lock);
+    delete cs;
+}
+
+// Crash ring, see SetLogCrashRing()
+static char crash_name[64];                  // shm_open() name of the segment
+static int crash_records = 0;                // Slots requested (0 = crash ring off)
+static std::atomic<log_crash_header *> crash_ring(NULL);  // Mapped segment, NULL when off
+static size_t crash_size = 0;                // Bytes mapped at crash_ring
+
+// Per-thread cache of the calendar part of the timestamp, rebuilt once a second
+struct time_cache {
+    time_t sec = -1;      // Second the cached text belongs to
+    char date[32];        // "Www Mmm dd hh:mm:ss", as printed by ctime()
+    int date_len;
+    char year[8];         // " yyyy"
+    int year_len;
+};
+static thread_local time_cache local_time;
+
+// Level names with their lengths, indexed by LOG_LEVEL
+static const struct {
+    char name[12];
+    int len;
+} level_names[] = {{"DEBUG", 5}, {"WARNING", 7}, {"ERROR", 5}, {"CRITICAL", 8}};
+
+// Appends the fields of a text record to a fixed buffer. Writes past the
+// end are cut short and remembered, so the record can be marked truncated.
+struct record_builder {
+    char *pos;            // Next byte to write
+    char *end;            // Last usable byte, kept for the terminator
+    int cut;              // Something did not fit
+};
+
+// A formatted record waiting in a ring slot
+struct log_record {
+    int len;              // Number of valid bytes in data
+    char data[BUF_LEN];   // Formatted log line
+};
+
+// Single-producer/single-consumer ring owned by one logging thread.
+// The owning thread advances head, the flusher thread advances tail.
+struct log_ring {
+    alignas(64) std::atomic<unsigned> head;   // Next slot to be written by the owner
+    alignas(64) std::atomic<unsigned> tail;   // Next slot to be sent by the flusher
+    int drop_oldest;                          // Fixed at creation: tail may be advanced by the owner
+    std::atomic<int> refs;                    // Owner thread + ring_list, freed at zero
+    std::atomic<int> detached;                // Set once ExitLog() removed it from ring_list
+    log_ring *next;                           // Next ring in ring_list
+    log_record slots[RING_SLOTS];
+};
+
+/**
+ * Drops one reference to a ring and frees it when it was the last.
+ */
+static void release_ring(log_ring *ring) {
+    if (ring->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete ring;
+    }
+}
+
+// State of the calling thread, torn down in order when the thread exits:
+// the open coalescing run is summarized while the ring and stats it is
+// delivered through still exist, then the ring is let go, then the stats
+// and the filtered calls not yet published.
+struct thread_handle {
+    coalesce_state *coalesce = NULL;  // See coalesce_record()
+    log_ring *ring = NULL;            // See get_local_ring()
+    thread_stats *stats = NULL;       // See get_local_stats()
+    ~thread_handle() {
+        if (coalesce) retire_coalesce(coalesce);
+        coalesce = NULL;
+        if (ring) release_ring(ring);
+        ring = NULL;
+        if (stats) retire_stats(stats);
+        stats = NULL;
+        stats_filtered.fetch_add(local_filtered & (FILTERED_BATCH - 1), std::memory_order_relaxed);
+        local_filtered = 0;
+    }
+};
+
+static log_ring *ring_list = NULL;      // All rings, walked by the flusher
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards ring_list
+static pthread_t flush_thread;          // Thread draining the rings to the socket
+static std::atomic<int> flusher_running(0);  // Flag to keep the flusher running
+static thread_local thread_handle local_thread;
+
+/**
+ * Returns the stats of the calling thread, allocating and registering
+ * them on first use.
+ *
+ * @return The stats, or NULL if allocation failed
+ */
+static thread_stats *get_local_stats() {
+    thread_stats *st = local_thread.stats;
+    if (st) return st;
+    st = new (std::nothrow) thread_stats();
+    if (!st) return NULL;
+    pthread_mutex_lock(&stats_mutex);  // Only taken once per thread
+    st->next = stats_list;
+    stats_list = st;
+    pthread_mutex_unlock(&stats_mutex);
+    local_thread.stats = st;
+    return st;
+}
+
+/**
+ * Counts a Log()/LogArgs() call below the level filter. A plain thread-local
+ * increment that never allocates; every FILTERED_BATCH calls the batch is
+ * added to stats_filtered, and the thread's handle publishes the rest when
+ * the thread exits.
+ */
+static inline void count_filtered() {
+    if ((++local_filtered & (FILTERED_BATCH - 1)) > 1) return;
+    if (local_filtered & (FILTERED_BATCH - 1)) {
+        (void)local_thread.stats;  // Constructs the handle on the thread's first filtered call
+    } else {
+        stats_filtered.fetch_add(FILTERED_BATCH, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Adds n to a counter of the calling thread's stats.
+ */
+static inline void stats_count(uint64_t thread_stats::*field, uint64_t n) {
+    thread_stats *st = get_local_stats();
+    if (st) __atomic_store_n(&(st->*field), st->*field + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns a timestamp for stats_time(), or 0 when timings are off.
+ */
+static inline uint64_t stats_clock() {
+    if (!stats_timing.load(std::memory_order_relaxed)) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Records the time since start, taken with stats_clock(), in one of the
+ * calling thread's histograms, allocating them on first use.
+ */
+static inline void stats_time(log_histogram thread_timings::*hist, uint64_t start) {
+    if (!start) return;
+    uint64_t end = stats_clock();
+    thread_stats *st = get_local_stats();
+    if (!st || !end) return;
+    thread_timings *t = st->timings;
+    if (!t) {
+        t = new (std::nothrow) thread_timings();
+        if (!t) return;
+        __atomic_store_n(&st->timings, t, __ATOMIC_RELEASE);  // Published to GetLogStats()
+    }
+    log_hist_add(&(t->*hist), end - start);
+}
+
+// An interned (file, func, line, level) tuple. The tuple is immutable once
+// published and entries live until the process exits; only the rate limit
+// state changes, lock-free.
+struct call_site {
+    uint32_t id;                       // Numeric ID sent in LOG_WIRE_REF records
+    uint32_t hash;                     // Hash of the tuple, speeds up probing
+    LOG_LEVEL level;
+    int line;
+    char *file;
+    char *func;
+    char *fmt;                         // Format string of Logf() sites, else NULL
+
+    // Token bucket as a generic cell rate algorithm: a record may pass when
+    // the theoretical arrival time tat is at most tolerance ahead of now
+    std::atomic<uint64_t> limit_interval; // ns per record at the sustained rate (0 = unlimited)
+    std::atomic<uint64_t> limit_tolerance; // Burst allowance in ns
+    std::atomic<uint32_t> limit_sample;   // Keep 1 in N records over the limit (0 = none)
+    std::atomic<uint64_t> tat;
+    std::atomic<uint32_t> excess;         // Records over the limit, picks the sampled ones
+    std::atomic<uint64_t> suppressed;     // Records held back since the last report
+};
+
+// A rate limit, see SetLogRateLimit()
+struct rate_limit {
+    uint64_t interval;        // ns per record (0 = unlimited)
+    uint64_t tolerance;       // Burst allowance in ns
+    uint32_t sample_n;        // Keep 1 in N records over the limit
+};
+
+// Per-site rate limit set by SetLogSiteRateLimit()
+struct site_limit {
+    char file[64];            // Basename of the source file
+    int line;                 // 0 = every line of the file
+    rate_limit limit;
+};
+
+static std::atomic<int> rate_limits_on(0);  // Any limit set, sites are looked up in text mode too
+static rate_limit default_limit;            // Of sites without an override, guarded by site_mutex
+static site_limit site_limits[MAX_SITE_LIMITS]; // Guarded by site_mutex
+static int num_site_limits = 0;
+
+// Open-addressed registry of call sites. Readers probe without locking;
+// inserts are serialized by site_mutex and published with a release store.
+static std::atomic<call_site *> site_table[SITE_TABLE_SIZE];
+static pthread_mutex_t site_mutex = PTHREAD_MUTEX_INITIALIZER; // Serializes inserts
+static uint32_t site_count = 0;        // Sites interned so far, guarded by site_mutex
+
+// When the calling thread last announced each site ID (seconds, 0 = never).
+// Announcing per thread keeps each announcement ahead of the thread's own
+// records in its ring, whatever order the flusher visits the rings in.
+static thread_local uint32_t site_announced[MAX_SITES + 1];
+
+// Batching configuration, see SetLogBatching()
+static int batch_records = 0;    // Flush after this many records (0 = batching off)
+static int batch_bytes = 0;      // Flush once this many payload bytes are queued (0 = no limit)
+static int batch_delay_us = 0;   // Flush once the oldest record is this old (0 = after every drain pass)
+static int batch_mtu = 0;        // Pack records into datagrams of up to this size (0 = one per datagram)
+
+// Datagrams collected by the flusher thread for one sendmmsg() call
+struct send_batch {
+    struct mmsghdr msgs[BATCH_MAX];
+    struct iovec iov[BATCH_MAX][2];  // Sequence header and payload of each datagram
+    uint8_t seq[BATCH_MAX][LOG_WIRE_SEQ_LEN];
+    int recs[BATCH_MAX];         // Records in each datagram
+    char *data;                  // BATCH_MAX datagram buffers of cap bytes each
+    int cap;                     // Capacity of each datagram buffer
+    int count;                   // Datagrams in use
+    int records;                 // Records queued
+    int bytes;                   // Payload bytes queued
+    struct timespec first;       // When the oldest queued record was added
+};
+static send_batch batch;         // Only touched by the flusher thread
+
+// Datagram compression, see SetLogCompression(). Only the flusher thread compresses.
+static int compress_on = 0;
+static log_lz_ctx lz_ctx;
+static char lz_single[BUF_LEN];  // Compressed record when batching is off
+
+/**
+ * Maps the server's shared-memory ring, replacing one the server has
+ * closed. An old mapping is left in place since other threads may still
+ * be writing to it.
+ *
+ * @return 0 on success, -1 if the server has not created the ring
+ */
+static int shm_attach() {
+    int fd = shm_open(LOG_SHM_NAME, O_RDWR, 0);
+    if (fd < 0) return -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(log_shm_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    log_shm_header *hdr = (log_shm_header *)map;
+    size_t need = sizeof(*hdr) + (size_t)hdr->slots * (sizeof(log_shm_slot) + hdr->slot_len);
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != LOG_SHM_MAGIC || hdr->version != LOG_SHM_VERSION ||
+        hdr->slots == 0 || (hdr->slots & (hdr->slots - 1)) || need > (size_t)st.st_size ||
+        __atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    shm_ring.store(hdr, std::memory_order_release);
+    return 0;
+}
+
+/**
+ * Returns whether LOG_TRANSPORT_SHM needs to (re-)attach to the ring.
+ */
+static int shm_detached() {
+    log_shm_header *hdr = shm_ring.load(std::memory_order_acquire);
+    return !hdr || __atomic_load_n(&hdr->closed, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copies one datagram into the server's shared-memory ring and wakes the
+ * server if it is waiting for data.
+ *
+ * @return 0 on success, -1 with errno EAGAIN (ring full), EMSGSIZE or
+ *         ENOTCONN (no ring)
+ */
+static int shm_put(const struct iovec *iov, int iovcnt) {
+    log_shm_header *hdr = shm_ring.load(std::memory_order_acquire);
+    if (!hdr || __atomic_load_n(&hdr->closed, __ATOMIC_RELAXED)) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+    if (len > hdr->slot_len) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // Claim a position whose slot the consumer has handed back
+    log_shm_slot *slot;
+    uint64_t pos = __atomic_load_n(&hdr->enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = log_shm_slot_at(hdr, pos & (hdr->slots - 1));
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&hdr->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            errno = EAGAIN;  // Ring full
+            return -1;
+        } else {
+            pos = __atomic_load_n(&hdr->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    __atomic_store_n(&slot->pid, getpid(), __ATOMIC_RELAXED);  // Lets the server tell a slow producer from a dead one
+    char *p = (char *)(slot + 1);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    slot->len = len;
+
+    // Publish, then look for a sleeper. Failing means the server gave up
+    // waiting and skipped the slot; hand it back to the next lap unread.
+    uint64_t expected = pos;
+    if (!__atomic_compare_exchange_n(&slot->seq, &expected, pos + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&slot->pid, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->seq, pos + hdr->slots, __ATOMIC_RELEASE);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (__atomic_load_n(&hdr->sleeping, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&hdr->sleeping, 0, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&hdr->wake, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &hdr->wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+/**
+ * Sends one datagram over the configured transport.
+ *
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int transport_send(struct msghdr *msg) {
+    uint64_t start = stats_clock();
+    int ret;
+    if (log_transport == LOG_TRANSPORT_SHM) ret = shm_put(msg->msg_iov, msg->msg_iovlen);
+    else ret = sendmsg(send_socket, msg, 0) < 0 ? -1 : 0;
+    int err = errno;
+    stats_time(&thread_timings::send, start);
+    if (ret == 0) stats_count(&thread_stats::datagrams, 1);
+    errno = err;
+    return ret;
+}
+
+/**
+ * Sends several datagrams over the configured transport.
+ *
+ * @return Number of datagrams sent, or -1 with errno set if none was
+ */
+static int transport_send_many(struct mmsghdr *msgs, int count) {
+    uint64_t start = stats_clock();
+    int sent = 0;
+    if (log_transport != LOG_TRANSPORT_SHM) {
+        sent = sendmmsg(send_socket, msgs, count, 0);
+    } else {
+        while (sent < count && shm_put(msgs[sent].msg_hdr.msg_iov, msgs[sent].msg_hdr.msg_iovlen) == 0) sent++;
+        if (!sent) sent = -1;
+    }
+    int err = errno;
+    stats_time(&thread_timings::send, start);
+    if (sent > 0) stats_count(&thread_stats::datagrams, sent);
+    errno = err;
+    return sent;
+}
+
+/**
+ * Introduces both sockets to the server. The hello from send_socket
+ * (or whichever transport carries the records) tells the server which
+ * client the log records come from, the one from recv_socket where
+ * level commands for that client go.
+ */
+static void send_hello() {
+    char msg[160];
+    int n = snprintf(msg, sizeof(msg), "Client Hello from send_socket id=%s group=%s", client_id, client_group);
+    struct iovec iov = {msg, (size_t)n};
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = &data_addr;
+    hdr.msg_namelen = data_addrlen;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    transport_send(&hdr);
+    n = snprintf(msg, sizeof(msg), "Client Hello from recv_socket id=%s group=%s", client_id, client_group);
+    sendto(recv_socket, msg, n, 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
+}
+
+static void report_drops();
+static void report_suppressed();
+static void coalesce_expire();
+static void coalesce_flush_all();
+
+/**
+ * Thread function to handle receiving commands from the server.
+ * Changes the log level based on the received message, repeats the
+ * hello messages so a restarted server learns about this client again,
+ * periodically reports records this process dropped or rate limited,
+ * summarizes runs of repeated records that went quiet, and re-attaches to
+ * the shared-memory ring of a restarted server.
+ */
+static void *receive_thread(void *arg) {
+    char buf[BUF_LEN];           // Buffer for storing received messages
+    struct sockaddr_in src_addr; // Source address of received messages
+    socklen_t addrlen = sizeof(src_addr);  // Length of the source address
+    time_t last_hello = time(NULL);
+    time_t last_report = last_hello;
+
+    // Main loop to receive messages from the server
+    while (server_running) {
+        if (log_transport == LOG_TRANSPORT_SHM && shm_detached() && shm_attach() == 0) {
+            last_hello = 0;  // New ring, the server does not know us yet
+        }
+        if (time(NULL) - last_hello >= HELLO_INTERVAL_SEC) {
+            send_hello();
+            last_hello = time(NULL);
+        }
+        if (coalesce_ms.load(std::memory_order_relaxed)) coalesce_expire();
+        if (time(NULL) - last_report >= DROP_REPORT_SEC) {
+            report_drops();
+            report_suppressed();
+            last_report = time(NULL);
+        }
+        memset(buf, 0, BUF_LEN);  // Clear the buffer
+        int n = recvfrom(recv_socket, buf, BUF_LEN - 1, 0, (struct sockaddr *)&src_addr, &addrlen);
+        if (n > 0) {
+            buf[n] = '\0';  // Null-terminate the received string
+            // If the message is a "Set Log Level" command, update the log level
+            if (strncmp(buf, "Set Log Level=", 14) == 0) {
+                int new_level = atoi(buf + 14);  // Extract new log level from the message
+                log_filter.store(new_level, std::memory_order_relaxed);  // Update the global log level
+            }
+        } else {
+            sleep(1);  // Sleep for 1 second if no message is received
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Formats the current time like ctime() with the configured number of
+ * sub-second digits after the seconds, e.g. "Fri Oct 16 04:48:01.123456 2026".
+ * The calendar conversion only runs when the second changes; otherwise
+ * just the fraction is rewritten.
+ *
+ * @param out Buffer of at least 40 bytes
+ * @return Number of characters written, excluding the terminator
+ */
+static int format_timestamp(char *out) {
+    int digits = time_precision.load(std::memory_order_relaxed);
+    struct timespec ts;
+    clock_gettime(digits ? CLOCK_REALTIME : CLOCK_REALTIME_COARSE, &ts);
+
+    time_cache *tc = &local_time;
+    if (ts.tv_sec != tc->sec) {
+        struct tm tm;
+        localtime_r(&ts.tv_sec, &tm);
+        tc->date_len = strftime(tc->date, sizeof(tc->date), "%a %b %e %H:%M:%S", &tm);
+        tc->year_len = strftime(tc->year, sizeof(tc->year), " %Y", &tm);
+        tc->sec = ts.tv_sec;
+    }
+
+    char *p = out;
+    memcpy(p, tc->date, tc->date_len);
+    p += tc->date_len;
+    if (digits) {
+        // Keep the leading digits of the nanosecond count
+        long frac = ts.tv_nsec;
+        for (int i = digits; i < 9; i++) frac /= 10;
+        *p++ = '.';
+        for (int i = digits - 1; i >= 0; i--) {
+            p[i] = '0' + frac % 10;
+            frac /= 10;
+        }
+        p += digits;
+    }
+    memcpy(p, tc->year, tc->year_len);
+    p += tc->year_len;
+    *p = '\0';
+    return p - out;
+}
+
+/**
+ * Appends n bytes of str, as many as fit.
+ */
+static inline void rb_put(record_builder *rb, const char *str, size_t n) {
+    size_t room = rb->end - rb->pos;
+    if (n > room) {
+        n = room;
+        rb->cut = 1;
+    }
+    memcpy(rb->pos, str, n);
+    rb->pos += n;
+}
+
+/**
+ * Appends one character if it fits.
+ */
+static inline void rb_char(record_builder *rb, char c) {
+    if (rb->pos < rb->end) {
+        *rb->pos++ = c;
+    } else {
+        rb->cut = 1;
+    }
+}
+
+/**
+ * Appends a decimal integer.
+ */
+static inline void rb_int(record_builder *rb, int v) {
+    char digits[12];
+    char *d = digits + sizeof(digits);
+    unsigned int u = v < 0 ? 0u - (unsigned int)v : (unsigned int)v;
+    do {
+        *--d = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0) *--d = '-';
+    rb_put(rb, d, digits + sizeof(digits) - d);
+}
+
+/**
+ * Formats a log record into buf as "<time> <LEVEL> <file>:<func>:<line>
+ * <message>". When args is not NULL, message is a printf-style format
+ * applied to the captured arguments. The fields are copied by hand rather
+ * than through snprintf(). A record longer than the buffer or the
+ * SetLogMaxRecord() limit ends in TRUNC_MARKER.
+ *
+ * @return Number of bytes written, excluding the terminator, or -1 on failure
+ */
+static int format_record(char *buf, int len, LOG_LEVEL level, const char *file, const char *func, int line,
+                         const char *message, const log_arg *args, int nargs) {
+    int limit = max_record.load(std::memory_order_relaxed);
+    if (limit > len) limit = len;
+    if (limit < (int)sizeof(TRUNC_MARKER) || (unsigned)level > CRITICAL) return -1;
+
+    record_builder rb = {buf, buf + limit - 1, 0};
+    char time_str[40];
+    rb_put(&rb, time_str, format_timestamp(time_str));
+    rb_char(&rb, ' ');
+    rb_put(&rb, level_names[level].name, level_names[level].len);
+    rb_char(&rb, ' ');
+    rb_put(&rb, file, strlen(file));
+    rb_char(&rb, ':');
+    rb_put(&rb, func, strlen(func));
+    rb_char(&rb, ':');
+    rb_int(&rb, line);
+    rb_char(&rb, ' ');
+    if (args && !rb.cut) {
+        // Format the arguments straight into the record; given the whole
+        // buffer, output reaching past the limit shows it did not fit
+        size_t room = buf + len - rb.pos;
+        size_t n = log_format_args(rb.pos, room, message, strlen(message), args, nargs);
+        if (rb.pos + n > rb.end || (n + 1 == room && rb.end == buf + len - 1)) {
+            rb.pos = rb.end;
+            rb.cut = 1;
+        } else {
+            rb.pos += n;
+        }
+    } else if (!args) {
+        rb_put(&rb, message, strlen(message));
+    }
+
+    if (rb.cut) {
+        // Overwrite the tail with the marker so the reader sees the cut
+        rb.pos = rb.end - (sizeof(TRUNC_MARKER) - 1);
+        memcpy(rb.pos, TRUNC_MARKER, sizeof(TRUNC_MARKER) - 1);
+        rb.pos += sizeof(TRUNC_MARKER) - 1;
+        truncated.fetch_add(1, std::memory_order_relaxed);
+    }
+    *rb.pos = '\0';
+    return rb.pos - buf;
+}
+
+/**
+ * Hashes a call-site tuple (FNV-1a over the strings, mixed with line and level).
+ */
+static uint32_t site_hash(LOG_LEVEL level, const char *file, const char *func, int line, const char *fmt) {
+    uint32_t h = 2166136261u;
+    for (const char *p = file; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+    h = (h ^ '\0') * 16777619u;
+    for (const char *p = func; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+    if (fmt) {
+        h = (h ^ '\0') * 16777619u;
+        for (const char *p = fmt; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    h = (h ^ (uint32_t)line) * 16777619u;
+    h = (h ^ (uint32_t)level) * 16777619u;
+    return h;
+}
+
+/**
+ * Returns whether an interned site matches a call-site tuple.
+ */
+static int site_matches(const call_site *site, uint32_t h, LOG_LEVEL level, const char *file, const char *func,
+                        int line, const char *fmt) {
+    return site->hash == h && site->line == line && site->level == level &&
+           strcmp(site->file, file) == 0 && strcmp(site->func, func) == 0 &&
+           (site->fmt ? fmt && strcmp(site->fmt, fmt) == 0 : !fmt);
+}
+
+/**
+ * Sets the rate limit of a site from the override matching its file and
+ * line, or the default. Called with site_mutex held.
+ */
+static void apply_limit(call_site *site) {
+    const rate_limit *limit = &default_limit;
+    for (int i = 0; i < num_site_limits; i++) {
+        const site_limit *sl = &site_limits[i];
+        if ((sl->line == 0 || sl->line == site->line) &&
+            (strcmp(site->file, sl->file) == 0 || strcmp(LogBasename(site->file), sl->file) == 0)) {
+            limit = &sl->limit;
+            if (sl->line) break;  // An exact line beats a whole file
+        }
+    }
+    site->limit_tolerance.store(limit->tolerance, std::memory_order_relaxed);
+    site->limit_sample.store(limit->sample_n, std::memory_order_relaxed);
+    site->limit_interval.store(limit->interval, std::memory_order_relaxed);
+}
+
+/**
+ * Returns the interned entry for a call site, creating it on first use.
+ *
+ * @param fmt Format string for sites that log through Logf(), else NULL
+ * @return The entry, or NULL when the registry is full
+ */
+static call_site *intern_site(LOG_LEVEL level, const char *file, const char *func, int line, const char *fmt) {
+    uint32_t h = site_hash(level, file, func, line, fmt);
+
+    // Lock-free lookup, the common case once a site has logged before
+    for (uint32_t i = 0; i < SITE_TABLE_SIZE; i++) {
+        call_site *site = site_table[(h + i) & (SITE_TABLE_SIZE - 1)].load(std::memory_order_acquire);
+        if (!site) break;
+        if (site_matches(site, h, level, file, func, line, fmt)) return site;
+    }
+
+    // Not found: insert under the lock, re-probing in case another thread won
+    call_site *found = NULL;
+    pthread_mutex_lock(&site_mutex);
+    for (uint32_t i = 0; i < SITE_TABLE_SIZE && !found; i++) {
+        std::atomic<call_site *> *slot = &site_table[(h + i) & (SITE_TABLE_SIZE - 1)];
+        call_site *site = slot->load(std::memory_order_relaxed);
+        if (site) {
+            if (site_matches(site, h, level, file, func, line, fmt)) found = site;
+            continue;
+        }
+        if (site_count >= MAX_SITES) break;  // Keep probe chains short
+
+        site = new (std::nothrow) call_site();
+        if (!site) break;
+        site->file = strdup(file);
+        site->func = strdup(func);
+        site->fmt = fmt ? strdup(fmt) : NULL;
+        if (!site->file || !site->func || (fmt && !site->fmt)) {
+            free(site->file);
+            free(site->func);
+            free(site->fmt);
+            delete site;
+            break;
+        }
+        site->id = ++site_count;
+        site->hash = h;
+        site->level = level;
+        site->line = line;
+        apply_limit(site);
+        slot->store(site, std::memory_order_release);
+        found = site;
+    }
+    pthread_mutex_unlock(&site_mutex);
+    return found;
+}
+
+/**
+ * Encodes a record with its call-site strings inline, formatting captured
+ * arguments on the client. Used when a site cannot be interned.
+ */
+static int encode_inline(char *buf, int len, LOG_LEVEL level, uint64_t ns, const char *file, const char *func,
+                         int line, const char *message, const log_arg *args, int nargs) {
+    char text[BUF_LEN];
+    if (args) {
+        log_format_args(text, sizeof(text), message, strlen(message), args, nargs);
+        message = text;
+    }
+    return log_wire_encode((uint8_t *)buf, len, level, ns, file, func, line, message);
+}
+
+/**
+ * Builds a record in the configured wire format. Binary records carry the
+ * raw timestamp and leave all text rendering to the server; records from
+ * Logf() carry their arguments unformatted. Each thread announces a call
+ * site once (and again every SITE_REANNOUNCE_SEC in case the announcement
+ * was lost or the server restarted), after which its records only carry
+ * the site's numeric ID.
+ *
+ * @param args Captured arguments when message is a format, else NULL
+ * @return Number of bytes written, or -1 on failure
+ */
+static int build_record(char *buf, int len, LOG_LEVEL level, const char *file, const char *func, int line,
+                        const char *message, const log_arg *args, int nargs) {
+    if (log_format == LOG_FORMAT_BINARY) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+        call_site *site = intern_site(level, file, func, line, args ? message : NULL);
+        if (!site) {
+            return encode_inline(buf, len, level, ns, file, func, line, message, args, nargs);
+        }
+
+        // Announce in the same datagram as the record that needs it
+        int n = 0;
+        uint32_t now = (uint32_t)ts.tv_sec;
+        if (now - site_announced[site->id] >= SITE_REANNOUNCE_SEC) {
+            if (args) {
+                n = log_wire_encode_fmt_site((uint8_t *)buf, len, level, site->id, file, func, line, message);
+            } else {
+                n = log_wire_encode_site((uint8_t *)buf, len, level, site->id, file, func, line);
+            }
+            if (n < 0) return encode_inline(buf, len, level, ns, file, func, line, message, args, nargs);
+            site_announced[site->id] = now;
+        }
+        int m;
+        if (args) {
+            m = log_wire_encode_args((uint8_t *)buf + n, len - n, level, ns, site->id, args, nargs);
+        } else {
+            m = log_wire_encode_ref((uint8_t *)buf + n, len - n, level, ns, site->id, message);
+        }
+        if (m < 0) return encode_inline(buf, len, level, ns, file, func, line, message, args, nargs);
+        return n + m;
+    }
+    return format_record(buf, len, level, file, func, line, message, args, nargs);
+}
+
+/**
+ * Creates and maps the crash ring segment. A segment left behind by an
+ * earlier process of the same name is replaced.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int crash_ring_open() {
+    uint32_t slots = 1;
+    while (slots < (uint32_t)crash_records) slots <<= 1;
+    size_t size = sizeof(log_crash_header) + (size_t)slots * CRASH_SLOT_SIZE;
+
+    shm_unlink(crash_name);
+    int fd = shm_open(crash_name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        shm_unlink(crash_name);
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // The mapping keeps the segment alive
+    if (map == MAP_FAILED) {
+        shm_unlink(crash_name);
+        return -1;
+    }
+
+    log_crash_header *hdr = (log_crash_header *)map;
+    hdr->version = LOG_CRASH_VERSION;
+    hdr->slots = slots;
+    hdr->slot_size = CRASH_SLOT_SIZE;
+    hdr->next = 0;
+    hdr->pid = getpid();
+    snprintf(hdr->client_id, sizeof(hdr->client_id), "%s", client_id);
+    __atomic_store_n(&hdr->magic, LOG_CRASH_MAGIC, __ATOMIC_RELEASE);  // Segment is valid from here on
+    crash_size = size;
+    crash_ring.store(hdr, std::memory_order_release);
+    return 0;
+}
+
+/**
+ * Writes a record to the crash ring as a text line. Text records that
+ * are already built are copied; otherwise (binary format, or a record
+ * dropped before it was built) the line is formatted straight into the
+ * slot. Writers share the atomic record counter and claim their slot with
+ * a compare-and-swap on its seq; a writer that laps onto a slot another one
+ * is still writing, or that a later record already took, leaves it alone.
+ *
+ * @param built The record in the wire format, or NULL if not built
+ * @param len Length of built
+ */
+static void crash_record(const char *built, int len, LOG_LEVEL level, const char *file, const char *func,
+                         int line, const char *message, const log_arg *args, int nargs) {
+    log_crash_header *hdr = crash_ring.load(std::memory_order_acquire);
+    if (!hdr) return;
+    uint64_t num = __atomic_fetch_add(&hdr->next, 1, __ATOMIC_RELAXED);
+    log_crash_slot *slot = log_crash_slot_at(hdr, num & (hdr->slots - 1));
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || seq > 2 * num ||
+        !__atomic_compare_exchange_n(&slot->seq, &seq, 2 * num + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);  // Mark the slot busy before touching the text
+
+    char *text = (char *)(slot + 1);
+    if (built && log_format == LOG_FORMAT_TEXT) {
+        memcpy(text, built, len);
+    } else {
+        len = format_record(text, BUF_LEN, level, file, func, line, message, args, nargs);
+        if (len < 0) len = 0;
+    }
+    slot->len = len;
+    __atomic_store_n(&slot->seq, 2 * num + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the overflow policy of the calling thread.
+ */
+static int current_overflow() {
+    return thread_overflow >= 0 ? thread_overflow : overflow_policy.load(std::memory_order_relaxed);
+}
+
+/**
+ * Returns the ring of the calling thread, allocating and registering
+ * it on first use.
+ *
+ * @return The ring, or NULL if allocation failed
+ */
+static log_ring *get_local_ring() {
+    log_ring *ring = local_thread.ring;
+    if (ring && !ring->detached.load(std::memory_order_relaxed)) return ring;
+    if (ring) {
+        local_thread.ring = NULL;  // Left over from before ExitLog(), start afresh
+        release_ring(ring);
+    }
+
+    ring = new (std::nothrow) log_ring();
+    if (!ring) return NULL;
+    ring->refs.store(2, std::memory_order_relaxed);  // Owner thread + ring_list
+    ring->drop_oldest = current_overflow() == LOG_OVERFLOW_DROP_OLDEST;
+
+    pthread_mutex_lock(&ring_mutex);  // Only taken once per thread
+    ring->next = ring_list;
+    ring_list = ring;
+    pthread_mutex_unlock(&ring_mutex);
+
+    local_thread.ring = ring;
+    return ring;
+}
+
+/**
+ * Returns the microseconds elapsed since start.
+ */
+static long elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * Allocates the datagram buffers used by the flusher when batching.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int batch_init() {
+    memset(&batch, 0, sizeof(batch));
+    batch.cap = batch_mtu > BUF_LEN ? batch_mtu : BUF_LEN;
+    // The second half holds the datagrams compressed
+    batch.data = (char *)malloc((size_t)batch.cap * BATCH_MAX * (compress_on ? 2 : 1));
+    if (!batch.data) return -1;
+    for (int i = 0; i < BATCH_MAX; i++) {
+        batch.iov[i][0].iov_base = batch.seq[i];
+        batch.iov[i][0].iov_len = LOG_WIRE_SEQ_LEN;
+        batch.iov[i][1].iov_base = batch.data + (size_t)i * batch.cap;
+        batch.msgs[i].msg_hdr.msg_iov = batch.iov[i];
+        batch.msgs[i].msg_hdr.msg_iovlen = 2;
+        batch.msgs[i].msg_hdr.msg_name = &data_addr;
+        batch.msgs[i].msg_hdr.msg_namelen = data_addrlen;
+    }
+    return 0;
+}
+
+/**
+ * Counts records the socket refused, by the reason it gave.
+ */
+static void count_drops(int err, int records) {
+    if (err == EAGAIN || err == EWOULDBLOCK) {
+        drop_eagain.fetch_add(records, std::memory_order_relaxed);
+    } else if (err == ENOBUFS) {
+        drop_enobufs.fetch_add(records, std::memory_order_relaxed);
+    } else {
+        drop_error.fetch_add(records, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Waits for the socket to take more data after a send failed with err,
+ * for at most wait_us counted from the first wait.
+ *
+ * @param start Set on the first wait
+ * @param waited Zero before the first wait, set by it
+ * @return 1 to retry the send, 0 to give up
+ */
+static int wait_for_room(int err, int wait_us, struct timespec *start, int *waited) {
+    if (!wait_us || (err != EAGAIN && err != EWOULDBLOCK && err != ENOBUFS)) return 0;
+    if (!*waited) {
+        clock_gettime(CLOCK_MONOTONIC, start);
+        block_waits.fetch_add(1, std::memory_order_relaxed);
+        *waited = 1;
+    }
+    long left = wait_us - elapsed_us(start);
+    if (left <= 0) return 0;
+    if (err == ENOBUFS || log_transport == LOG_TRANSPORT_SHM) {
+        usleep(left < RING_WAIT_US ? left : RING_WAIT_US);  // Nothing to poll for
+    } else {
+        struct pollfd pfd = {send_socket, POLLOUT, 0};
+        struct timespec ts = {left / 1000000, (left % 1000000) * 1000};
+        ppoll(&pfd, 1, &ts, NULL);
+    }
+    return 1;
+}
+
+/**
+ * Sends one datagram of records behind its sequence header. Records the
+ * non-blocking socket refuses are dropped and counted; they keep their
+ * sequence numbers, so the server sees the loss as well.
+ *
+ * @param records Number of records in data
+ * @param wait_us Wait up to this long for socket room before dropping (0 = never wait)
+ */
+static void send_records(const char *data, int len, int records, int wait_us) {
+    uint8_t seq[LOG_WIRE_SEQ_LEN];
+    log_wire_encode_seq(seq, send_seq.fetch_add(records, std::memory_order_relaxed), records);
+    struct iovec iov[2] = {{seq, sizeof(seq)}, {(void *)data, (size_t)len}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &data_addr;
+    msg.msg_namelen = data_addrlen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    struct timespec start;
+    int waited = 0;
+    while (transport_send(&msg) < 0) {
+        int err = errno;
+        if (wait_for_room(err, wait_us, &start, &waited)) continue;
+        if (waited) {
+            drop_timeout.fetch_add(records, std::memory_order_relaxed);
+        } else {
+            count_drops(err, records);
+        }
+        return;
+    }
+    sent_records.fetch_add(records, std::memory_order_relaxed);
+}
+
+/**
+ * Returns how long the flusher waits for socket room. With any policy but
+ * LOG_OVERFLOW_DROP_NEWEST it waits, so a full socket backs up into the
+ * rings where each thread's own policy decides what is lost.
+ */
+static int flush_wait_us() {
+    if (overflow_policy.load(std::memory_order_relaxed) == LOG_OVERFLOW_DROP_NEWEST) return 0;
+    return overflow_timeout_us.load(std::memory_order_relaxed);
+}
+
+/**
+ * Hands every queued datagram to the kernel with as few sendmmsg() calls
+ * as possible. Datagrams the non-blocking socket refuses are dropped and
+ * counted.
+ */
+static void batch_flush() {
+    for (int i = 0; i < batch.count; i++) {
+        log_wire_encode_seq(batch.seq[i], send_seq.fetch_add(batch.recs[i], std::memory_order_relaxed), batch.recs[i]);
+        if (compress_on) {
+            struct iovec *iov = &batch.iov[i][1];
+            char *out = batch.data + (size_t)(BATCH_MAX + i) * batch.cap;
+            int n = log_wire_encode_lz(&lz_ctx, (const uint8_t *)iov->iov_base, iov->iov_len, (uint8_t *)out, batch.cap);
+            packed_in.fetch_add(iov->iov_len, std::memory_order_relaxed);
+            if (n > 0) {
+                iov->iov_base = out;
+                iov->iov_len = n;
+            }
+            packed_out.fetch_add(iov->iov_len, std::memory_order_relaxed);
+        }
+    }
+    int done = 0;
+    struct timespec start;
+    int waited = 0;
+    while (done < batch.count) {
+        int n = transport_send_many(batch.msgs + done, batch.count - done);
+        if (n <= 0) {
+            int err = n < 0 ? errno : EAGAIN;
+            if (wait_for_room(err, flush_wait_us(), &start, &waited)) continue;
+
+            // Socket buffer full, drop the rest
+            int lost = 0;
+            for (int i = done; i < batch.count; i++) lost += batch.recs[i];
+            if (waited) {
+                drop_timeout.fetch_add(lost, std::memory_order_relaxed);
+            } else {
+                count_drops(err, lost);
+            }
+            break;
+        }
+        for (int i = done; i < done + n; i++) {
+            sent_records.fetch_add(batch.recs[i], std::memory_order_relaxed);
+        }
+        done += n;
+    }
+    for (int i = 0; compress_on && i < batch.count; i++) {
+        batch.iov[i][1].iov_base = batch.data + (size_t)i * batch.cap;  // batch_add() appends here
+    }
+    batch.count = 0;
+    batch.records = 0;
+    batch.bytes = 0;
+}
+
+/**
+ * Appends a record to the current batch, packing it into the last
+ * datagram when batch_mtu allows, and flushes on the count/byte limits.
+ */
+static void batch_add(const char *data, int len) {
+    // Packed text records are separated by newlines, binary ones carry their length
+    int sep = log_format == LOG_FORMAT_TEXT;
+    struct iovec *last = batch.count ? &batch.iov[batch.count - 1][1] : NULL;
+    if (batch_mtu && last && LOG_WIRE_SEQ_LEN + (int)last->iov_len + sep + len <= batch_mtu) {
+        char *end = (char *)last->iov_base + last->iov_len;
+        if (sep) *end = '\n';
+        memcpy(end + sep, data, len);
+        last->iov_len += sep + len;
+        batch.recs[batch.count - 1]++;
+    } else {
+        if (batch.count == BATCH_MAX) batch_flush();
+        batch.recs[batch.count] = 1;
+        struct iovec *iov = &batch.iov[batch.count++][1];
+        memcpy(iov->iov_base, data, len);
+        iov->iov_len = len;
+    }
+
+    if (batch.records++ == 0) clock_gettime(CLOCK_MONOTONIC, &batch.first);
+    batch.bytes += len;
+    if (batch.records >= batch_records || (batch_bytes && batch.bytes >= batch_bytes)) {
+        batch_flush();
+    }
+}
 
 /**
- * Thread function to handle receiving commands from the server.
- * Changes the log level based on the received message.
+ * Queues or sends one record taken from a ring.
  */
-static void *receive_thread(void *arg) {
-    char buf[BUF_LEN];           // Buffer for storing received messages
-    struct sockaddr_in src_addr; // Source address of received messages
-    socklen_t addrlen = sizeof(src_addr);  // Length of the source address
-
-    // Main loop to receive messages from the server
-    while (server_running) {
-        memset(buf, 0, BUF_LEN);  // Clear the buffer
-        int n = recvfrom(recv_socket, buf, BUF_LEN - 1, 0, (struct sockaddr *)&src_addr, &addrlen);
+static void flush_record(const char *data, int len) {
+    if (batch_records) {
+        batch_add(data, len);
+        return;
+    }
+    if (compress_on) {
+        int n = log_wire_encode_lz(&lz_ctx, (const uint8_t *)data, len, (uint8_t *)lz_single, sizeof(lz_single));
+        packed_in.fetch_add(len, std::memory_order_relaxed);
         if (n > 0) {
-            buf[n] = '\0';  // Null-terminate the received string
-            // If the message is a "Set Log Level" command, update the log level
-            if (strncmp(buf, "Set Log Level=", 14) == 0) {
-                int new_level = atoi(buf + 14);  // Extract new log level from the message
-                pthread_mutex_lock(&log_mutex);  // Lock the mutex for thread safety
-                log_filter = (LOG_LEVEL)new_level;  // Update the global log level
-                pthread_mutex_unlock(&log_mutex);  // Unlock the mutex
+            data = lz_single;
+            len = n;
+        }
+        packed_out.fetch_add(len, std::memory_order_relaxed);
+    }
+    send_records(data, len, 1, flush_wait_us());
+}
+
+/**
+ * Sends the records of a LOG_OVERFLOW_DROP_OLDEST ring. The owner may
+ * discard the oldest record at any time, so each slot is copied first
+ * and only sent if tail still pointed at it afterwards.
+ *
+ * The copy is a seqlock-style read: it can overlap the owner rewriting the
+ * slot, which is formally a data race. The compare-and-swap on tail, whose
+ * release ordering keeps the copy before it, throws away any copy the owner
+ * may have touched, and the length is clamped so a torn one stays in bounds.
+ *
+ * @return Number of records sent
+ */
+static int drain_overwriting(log_ring *ring, unsigned head) {
+    static log_record copy;  // Only touched by the flusher thread
+    int sent = 0;
+    unsigned tail = ring->tail.load(std::memory_order_acquire);
+    while ((int)(head - tail) > 0) {
+        const log_record *rec = &ring->slots[tail & (RING_SLOTS - 1)];
+        int len = rec->len;
+        if (len < 0 || len > BUF_LEN) len = 0;  // Torn by the owner, discarded below
+        memcpy(copy.data, rec->data, len);
+        if (!ring->tail.compare_exchange_strong(tail, tail + 1, std::memory_order_acq_rel,
+                                                std::memory_order_acquire)) {
+            continue;  // Overwritten while copying, tail now holds the owner's value
+        }
+        flush_record(copy.data, len);
+        tail++;
+        sent++;
+    }
+    return sent;
+}
+
+/**
+ * Sends every record currently queued in the rings and releases rings
+ * whose owning thread has exited.
+ *
+ * @return Number of records sent
+ */
+static int drain_rings() {
+    int sent = 0;
+    pthread_mutex_lock(&ring_mutex);
+    log_ring **link = &ring_list;
+    while (*link) {
+        log_ring *ring = *link;
+        // A single reference means the owner has exited. Read it before
+        // head so the owner's final record is not missed.
+        int orphaned = ring->refs.load(std::memory_order_acquire) == 1;
+        unsigned head = ring->head.load(std::memory_order_acquire);
+        if (ring->drop_oldest) {
+            sent += drain_overwriting(ring, head);
+        } else {
+            unsigned tail = ring->tail.load(std::memory_order_relaxed);
+            while (tail != head) {
+                log_record *rec = &ring->slots[tail & (RING_SLOTS - 1)];
+                flush_record(rec->data, rec->len);
+                tail++;
+                sent++;
             }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+
+        if (orphaned) {
+            *link = ring->next;  // Owner is gone and the ring is empty
+            delete ring;
         } else {
-            sleep(1);  // Sleep for 1 second if no message is received
+            link = &ring->next;
         }
     }
+    pthread_mutex_unlock(&ring_mutex);
+    return sent;
+}
+
+/**
+ * Thread function that drains the per-thread rings to the server.
+ * Performs a final drain after ExitLog() clears flusher_running.
+ */
+static void *flusher_thread(void *arg) {
+    while (flusher_running.load(std::memory_order_acquire)) {
+        int sent = drain_rings();
+
+        // Send a partial batch once its oldest record reaches the deadline
+        long wait_us = FLUSH_IDLE_US;
+        if (batch.records) {
+            long age = elapsed_us(&batch.first);
+            if (age >= batch_delay_us) {
+                batch_flush();
+            } else if (batch_delay_us - age < wait_us) {
+                wait_us = batch_delay_us - age;
+            }
+        }
+        if (sent == 0) {
+            usleep(wait_us);  // Nothing queued, back off briefly
+        }
+    }
+    drain_rings();
+    if (batch.records) batch_flush();
     return NULL;
 }
 
+/**
+ * Selects how Log() delivers records. Must be called before InitializeLog().
+ *
+ * @param mode LOG_MODE_SYNC to send from the calling thread, LOG_MODE_ASYNC
+ *             to queue in a per-thread ring drained by a flusher thread
+ */
+void SetLogMode(LOG_MODE mode) {
+    log_mode = mode;
+}
+
+/**
+ * Selects the wire format of log records. Must be called before InitializeLog().
+ *
+ * @param format LOG_FORMAT_TEXT or LOG_FORMAT_BINARY
+ */
+void SetLogFormat(LOG_FORMAT format) {
+    log_format = format;
+}
+
+/**
+ * Limits the size of text records. Longer records are cut and end in
+ * "...[truncated]". Records never exceed the BUF_LEN buffers they are
+ * built in, so the limit can only lower that. May be called at any time.
+ *
+ * @param bytes Largest record in bytes, counting a terminator (MIN_RECORD_LEN to BUF_LEN, default BUF_LEN)
+ */
+void SetLogMaxRecord(int bytes) {
+    if (bytes < MIN_RECORD_LEN) bytes = MIN_RECORD_LEN;
+    if (bytes > BUF_LEN) bytes = BUF_LEN;
+    max_record.store(bytes, std::memory_order_relaxed);
+}
+
+/**
+ * Sets how many sub-second digits record timestamps carry.
+ *
+ * @param precision LOG_TIME_SEC, LOG_TIME_MSEC, LOG_TIME_USEC or LOG_TIME_NSEC
+ */
+void SetLogTimePrecision(LOG_TIME_PRECISION precision) {
+    time_precision.store(precision, std::memory_order_relaxed);
+}
+
+/**
+ * Enables batched delivery: the flusher thread collects records and
+ * hands them to the kernel with one sendmmsg() call per batch. Implies
+ * LOG_MODE_ASYNC. Must be called before InitializeLog().
+ *
+ * @param max_records Flush once this many records are queued (0 disables batching)
+ * @param max_bytes Flush once this many payload bytes are queued (0 = no byte limit)
+ * @param max_delay_us Flush once the oldest queued record is this old
+ *                     (0 = flush after every pass over the rings)
+ * @param mtu Pack newline-separated records into datagrams of up to this
+ *            many bytes (0 = one record per datagram)
+ */
+void SetLogBatching(int max_records, int max_bytes, int max_delay_us, int mtu) {
+    batch_records = max_records > 0 ? max_records : 0;
+    batch_bytes = max_bytes > 0 ? max_bytes : 0;
+    batch_delay_us = max_delay_us > 0 ? max_delay_us : 0;
+    batch_mtu = mtu > 0 ? (mtu < MAX_DGRAM ? mtu : MAX_DGRAM) : 0;
+    if (batch_records) log_mode = LOG_MODE_ASYNC;
+}
+
+/**
+ * Compresses the datagrams the flusher thread sends (LOG_MODE_ASYNC) with
+ * the LZ codec of LogProtocol.h and its preset dictionary of log text.
+ * Datagrams that do not get smaller are sent as they are. Works best with
+ * SetLogBatching() packing several records per datagram. Must be called
+ * before InitializeLog().
+ *
+ * @param enable 1 to compress, 0 to send uncompressed (default)
+ */
+void SetLogCompression(int enable) {
+    compress_on = enable != 0;
+}
+
+/**
+ * Collapses identical consecutive records of a thread, as a retry loop
+ * logging the same failure produces, into the first record and a summary:
+ * "last message repeated N times (first <time>, last <time>)". The summary
+ * is logged when the thread logs something else, every timeout_ms while
+ * the repeats go on, and timeout_ms after the last repeat otherwise. May
+ * be called at any time.
+ *
+ * @param timeout_ms Longest time a run of repeats stays unreported (0 = off, default)
+ */
+void SetLogCoalescing(int timeout_ms) {
+    int was = coalesce_ms.exchange(timeout_ms > 0 ? timeout_ms : 0, std::memory_order_relaxed);
+    if (was && timeout_ms <= 0) coalesce_flush_all();  // Report what the runs held back so far
+}
+
+/**
+ * Converts a rate limit given as records per second and burst size.
+ */
+static rate_limit make_limit(int per_sec, int burst, int sample_n) {
+    rate_limit limit = {0, 0, 0};
+    if (per_sec > 0) {
+        limit.interval = 1000000000ULL / per_sec;
+        limit.tolerance = limit.interval * (burst > 1 ? burst - 1 : 0);
+        limit.sample_n = sample_n > 0 ? sample_n : 0;
+    }
+    return limit;
+}
+
+/**
+ * Re-applies the limits to every interned site. Called with site_mutex held.
+ */
+static void apply_limits() {
+    int on = default_limit.interval != 0;
+    for (int i = 0; i < num_site_limits; i++) on |= site_limits[i].limit.interval != 0;
+    for (uint32_t i = 0; i < SITE_TABLE_SIZE; i++) {
+        call_site *site = site_table[i].load(std::memory_order_relaxed);
+        if (site) apply_limit(site);
+    }
+    rate_limits_on.store(on, std::memory_order_relaxed);
+}
+
+/**
+ * Limits how many records every call site may log, so one hot loop cannot
+ * flood the socket and the server's log at the expense of all other sites.
+ * Each site gets a token bucket refilled at per_sec records per second and
+ * holding up to burst records. Records over the limit are suppressed, or
+ * with sample_n set, 1 in sample_n of them still logged. Suppressed records
+ * are counted per site and reported every 10 seconds in a record from the
+ * site, e.g. "[rate limit] 4500 records suppressed". May be called at any
+ * time; SetLogSiteRateLimit() overrides it for single sites.
+ *
+ * @param per_sec Sustained records per second per site (0 = no limit, default)
+ * @param burst Records a site may log at once after being quiet
+ * @param sample_n Keep 1 in sample_n records over the limit (0 = none)
+ */
+void SetLogRateLimit(int per_sec, int burst, int sample_n) {
+    pthread_mutex_lock(&site_mutex);
+    default_limit = make_limit(per_sec, burst, sample_n);
+    apply_limits();
+    pthread_mutex_unlock(&site_mutex);
+}
+
+/**
+ * Sets the rate limit of the call sites at one source line, or of a whole
+ * file, instead of the SetLogRateLimit() default. A limit for an exact
+ * line takes precedence over one for its file.
+ *
+ * @param file Source file as logged, or its basename
+ * @param line Line number, 0 for every line of the file
+ * @param per_sec Sustained records per second (0 = no limit for this site)
+ * @return 0 on success, -1 if MAX_SITE_LIMITS overrides are already set
+ */
+int SetLogSiteRateLimit(const char *file, int line, int per_sec, int burst, int sample_n) {
+    file = LogBasename(file);
+    pthread_mutex_lock(&site_mutex);
+    int i = 0;
+    while (i < num_site_limits && !(site_limits[i].line == line && strcmp(site_limits[i].file, file) == 0)) i++;
+    if (i == MAX_SITE_LIMITS) {
+        pthread_mutex_unlock(&site_mutex);
+        return -1;
+    }
+    if (i == num_site_limits) {
+        snprintf(site_limits[i].file, sizeof(site_limits[i].file), "%s", file);
+        site_limits[i].line = line;
+        num_site_limits++;
+    }
+    site_limits[i].limit = make_limit(per_sec, burst, sample_n);
+    apply_limits();
+    pthread_mutex_unlock(&site_mutex);
+    return 0;
+}
+
+/**
+ * Sets the name and group this process registers with at the server.
+ * Level commands can target a single client by id or all clients of a
+ * group. Must be called before InitializeLog().
+ *
+ * @param id Unique client name without spaces (NULL = "<hostname>:<pid>")
+ * @param group Group name without spaces (NULL = "default")
+ */
+void SetLogClientId(const char *id, const char *group) {
+    if (id) snprintf(client_id, sizeof(client_id), "%s", id);
+    if (group) snprintf(client_group, sizeof(client_group), "%s", group);
+}
+
+/**
+ * Selects what happens to a record when the local queue or the socket is
+ * full. Every policy counts what it loses, see GetLogCounters(), and a
+ * summary record is sent every DROP_REPORT_SEC while records are being
+ * dropped. LOG_OVERFLOW_DROP_OLDEST only applies to rings created after
+ * the call, so set it before logging starts. LOG_OVERFLOW_DROP_OLDEST and
+ * LOG_OVERFLOW_SAMPLE need LOG_MODE_ASYNC and drop the newest record in
+ * sync mode.
+ *
+ * @param policy Policy for every thread without its own, see SetLogThreadOverflow()
+ * @param timeout_us Longest wait of LOG_OVERFLOW_BLOCK (0 = OVERFLOW_TIMEOUT_US)
+ * @param sample_n LOG_OVERFLOW_SAMPLE keeps 1 in this many records (0 = 10)
+ */
+void SetLogOverflow(LOG_OVERFLOW policy, int timeout_us, int sample_n) {
+    overflow_timeout_us.store(timeout_us > 0 ? timeout_us : OVERFLOW_TIMEOUT_US, std::memory_order_relaxed);
+    overflow_sample_n.store(sample_n > 0 ? sample_n : 10, std::memory_order_relaxed);
+    overflow_policy.store(policy, std::memory_order_relaxed);
+}
+
+/**
+ * Overrides the overflow policy for the calling thread, e.g. so a
+ * latency-critical thread never blocks under a global LOG_OVERFLOW_BLOCK.
+ * LOG_OVERFLOW_DROP_OLDEST must be set before the thread's first record.
+ *
+ * @param policy Policy for records logged by this thread
+ */
+void SetLogThreadOverflow(LOG_OVERFLOW policy) {
+    thread_overflow = policy;
+}
+
+/**
+ * Keeps the last records of this process in a shared-memory segment,
+ * /dev/shm/<name>, that outlives a crash. Every record that passes the
+ * level filter is written there as a text line, including records later
+ * dropped by the overflow policy. ExitLog() removes the segment; after a
+ * crash, LogRecover prints its contents. Must be called before InitializeLog().
+ *
+ * @param name shm_open() name, e.g. "/myapp.log" (NULL = "/logger.<pid>")
+ * @param records Number of records kept, rounded up to a power of two (0 disables)
+ */
+void SetLogCrashRing(const char *name, int records) {
+    if (name) {
+        snprintf(crash_name, sizeof(crash_name), "%s", name);
+    } else {
+        snprintf(crash_name, sizeof(crash_name), "/logger.%d", (int)getpid());
+    }
+    crash_records = records > 0 ? records : 0;
+}
+
+/**
+ * Selects how records reach a LogServer on the same host. Hellos and
+ * level commands keep using UDP. Must be called before InitializeLog().
+ *
+ * @param transport LOG_TRANSPORT_UDP, LOG_TRANSPORT_UNIX or LOG_TRANSPORT_SHM
+ */
+void SetLogTransport(LOG_TRANSPORT transport) {
+    log_transport = transport;
+}
+
+/**
+ * Opens the record transport. A shared-memory ring the server has not
+ * created yet is attached later by the receive thread; records logged
+ * until then are dropped and counted as send errors.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int transport_open() {
+    memset(&data_addr, 0, sizeof(data_addr));
+    if (log_transport == LOG_TRANSPORT_SHM) {
+        shm_attach();
+        if (batch_mtu > LOG_SHM_SLOT_LEN) batch_mtu = LOG_SHM_SLOT_LEN;  // Packed datagrams must fit a slot
+        return 0;
+    }
+
+    if (log_transport == LOG_TRANSPORT_UNIX) {
+        send_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (send_socket < 0) return -1;
+        // Autobind to a unique abstract address the server can tell us apart by
+        sa_family_t family = AF_UNIX;
+        if (bind(send_socket, (struct sockaddr *)&family, sizeof(family)) < 0) {
+            close(send_socket);
+            return -1;
+        }
+        struct sockaddr_un *addr = (struct sockaddr_un *)&data_addr;
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path + 1, LOG_LOCAL_SOCKET);  // Leading NUL: abstract name
+        data_addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(LOG_LOCAL_SOCKET);
+    } else {
+        send_socket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (send_socket < 0) return -1;
+        memcpy(&data_addr, &server_addr, sizeof(server_addr));
+        data_addrlen = sizeof(server_addr);
+    }
+    int flags = fcntl(send_socket, F_GETFL, 0);
+    fcntl(send_socket, F_SETFL, flags | O_NONBLOCK);  // Set socket to non-blocking
+    return 0;
+}
+
 /**
  * Initializes logging system by creating necessary sockets
  * and setting up the server communication.
@@ -61,14 +1632,17 @@ static void *receive_thread(void *arg) {
  * @return 0 on success, -1 on failure
  */
 int InitializeLog() {
-    // Create a socket for sending logs to the server
-    send_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (send_socket < 0) {
+    // Configure server address for communication
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(SERVER_PORT);
+    inet_aton(SERVER_IP, &server_addr.sin_addr);
+
+    // Open the transport for sending logs to the server
+    if (transport_open() < 0) {
         perror("Socket creation failed (send)");
         return -1;
     }
-    int flags = fcntl(send_socket, F_GETFL, 0);
-    fcntl(send_socket, F_SETFL, flags | O_NONBLOCK);  // Set socket to non-blocking
 
     // Create a socket for receiving commands from the server
     recv_socket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -77,7 +1651,7 @@ int InitializeLog() {
         close(send_socket);
         return -1;
     }
-    flags = fcntl(recv_socket, F_GETFL, 0);
+    int flags = fcntl(recv_socket, F_GETFL, 0);
     fcntl(recv_socket, F_SETFL, flags | O_NONBLOCK);  // Set socket to non-blocking
 
     // Set up client address and bind the receiving socket to the CLIENT_PORT
@@ -87,21 +1661,31 @@ int InitializeLog() {
     client_addr.sin_addr.s_addr = INADDR_ANY;
     client_addr.sin_port = htons(CLIENT_PORT);
     if (bind(recv_socket, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0) {
+        // Another client on this host has the port; the hello tells the
+        // server which port we got instead
+        client_addr.sin_port = 0;
+    }
+    if (client_addr.sin_port == 0 && bind(recv_socket, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0) {
         perror("Bind failed");
         close(send_socket);
         close(recv_socket);
         return -1;
     }
 
-    // Configure server address for communication
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    inet_aton(SERVER_IP, &server_addr.sin_addr);
+    // Send initial hello messages from the client to the server
+    if (!client_id[0]) {
+        char host[48];
+        if (gethostname(host, sizeof(host)) < 0) strcpy(host, "localhost");
+        host[sizeof(host) - 1] = '\0';
+        snprintf(client_id, sizeof(client_id), "%s:%d", host, (int)getpid());
+    }
+    if (!client_group[0]) strcpy(client_group, "default");
+    send_hello();
 
-    // Send initial hello message from the client to the server
-    const char *hello_msg = "Client Hello from recv_socket";
-    sendto(recv_socket, hello_msg, strlen(hello_msg), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
+    // Map the crash ring; logging works without it
+    if (crash_records && crash_ring_open() < 0) {
+        perror("Crash ring creation failed");
+    }
 
     // Start the receive thread
     server_running = 1;
@@ -111,6 +1695,30 @@ int InitializeLog() {
         close(recv_socket);
         return -1;
     }
+
+    // Start the flusher thread when records are delivered asynchronously
+    if (log_mode == LOG_MODE_ASYNC) {
+        if (batch_records && batch_init() < 0) {
+            perror("Batch allocation failed");
+            server_running = 0;
+            pthread_join(recv_thread, NULL);
+            close(send_socket);
+            close(recv_socket);
+            return -1;
+        }
+        flusher_running.store(1, std::memory_order_release);
+        if (pthread_create(&flush_thread, NULL, flusher_thread, NULL) != 0) {
+            perror("Flusher thread creation failed");
+            flusher_running.store(0, std::memory_order_release);
+            free(batch.data);
+            batch.data = NULL;
+            server_running = 0;
+            pthread_join(recv_thread, NULL);
+            close(send_socket);
+            close(recv_socket);
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -120,9 +1728,276 @@ int InitializeLog() {
  * @param level The desired log level (DEBUG, WARNING, ERROR, CRITICAL)
  */
 void SetLogLevel(LOG_LEVEL level) {
-    pthread_mutex_lock(&log_mutex);    // Lock the mutex for thread safety
-    log_filter = level;                // Update the log level filter
+    log_filter.store(level, std::memory_order_relaxed);  // Update the log level filter
+}
+
+/**
+ * Frees the slot at head of a full ring according to the overflow policy.
+ *
+ * @return 1 if the slot at head is free, 0 if the new record is dropped
+ */
+static int make_room(log_ring *ring, unsigned head, int policy) {
+    if (policy == LOG_OVERFLOW_DROP_OLDEST && ring->drop_oldest) {
+        // Discard the oldest record unless the flusher just took it
+        unsigned tail = head - RING_SLOTS;
+        if (ring->tail.compare_exchange_strong(tail, tail + 1, std::memory_order_acq_rel)) {
+            drop_oldest.fetch_add(1, std::memory_order_relaxed);
+        }
+        return 1;
+    }
+    if (policy == LOG_OVERFLOW_BLOCK) {
+        block_waits.fetch_add(1, std::memory_order_relaxed);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (head - ring->tail.load(std::memory_order_acquire) == RING_SLOTS) {
+            if (elapsed_us(&start) >= overflow_timeout_us.load(std::memory_order_relaxed)) {
+                drop_timeout.fetch_add(1, std::memory_order_relaxed);
+                return 0;
+            }
+            usleep(RING_WAIT_US);
+        }
+        return 1;
+    }
+    drop_ring.fetch_add(1, std::memory_order_relaxed);  // Ring full, drop the record
+    return 0;
+}
+
+/**
+ * Checks a record against the rate limit of its call site. Lock-free: one
+ * compare-and-swap on the site's token bucket, plus a counter for records
+ * over the limit.
+ *
+ * @return 1 if the record is to be suppressed, 0 to log it
+ */
+static int rate_limited(call_site *site) {
+    uint64_t interval = site->limit_interval.load(std::memory_order_relaxed);
+    if (!interval) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    uint64_t tolerance = site->limit_tolerance.load(std::memory_order_relaxed);
+    uint64_t tat = site->tat.load(std::memory_order_relaxed);
+    while (tat <= now + tolerance) {
+        if (site->tat.compare_exchange_weak(tat, (tat > now ? tat : now) + interval, std::memory_order_relaxed)) {
+            return 0;  // Within the rate or the burst
+        }
+    }
+    uint32_t n = site->limit_sample.load(std::memory_order_relaxed);
+    if (n && site->excess.fetch_add(1, std::memory_order_relaxed) % n == 0) return 0;  // The 1 in N kept
+    site->suppressed.fetch_add(1, std::memory_order_relaxed);
+    rate_suppressed.fetch_add(1, std::memory_order_relaxed);
+    return 1;
+}
+
+/**
+ * Builds a record and queues or sends it.
+ *
+ * @param args Captured arguments when message is a format, else NULL
+ */
+static void deliver_record(LOG_LEVEL level, const char *file, const char *func, int line,
+                           const char *message, const log_arg *args, int nargs) {
+    uint64_t start = stats_clock();
+    stats_count(&thread_stats::calls, 1);
+    int policy = current_overflow();
+    if (log_mode == LOG_MODE_ASYNC) {
+        log_ring *ring = get_local_ring();
+        if (!ring) return;
+
+        // Only this thread writes head, so the slot at head is ours once
+        // the flusher has moved tail past it
+        unsigned head = ring->head.load(std::memory_order_relaxed);
+        unsigned used = head - ring->tail.load(std::memory_order_acquire);
+        if (policy == LOG_OVERFLOW_SAMPLE && used >= RING_SLOTS / 2 &&
+            sample_count++ % overflow_sample_n.load(std::memory_order_relaxed)) {
+            drop_sampled.fetch_add(1, std::memory_order_relaxed);  // Not the 1 in N kept
+            crash_record(NULL, 0, level, file, func, line, message, args, nargs);
+            return;
+        }
+        if (used == RING_SLOTS && !make_room(ring, head, policy)) {
+            crash_record(NULL, 0, level, file, func, line, message, args, nargs);
+            return;
+        }
+        log_record *rec = &ring->slots[head & (RING_SLOTS - 1)];
+        uint64_t built = stats_clock();
+        rec->len = build_record(rec->data, BUF_LEN, level, file, func, line, message, args, nargs);
+        stats_time(&thread_timings::build, built);
+        if (rec->len < 0) return;
+        stats_count(&thread_stats::bytes, rec->len);
+        crash_record(rec->data, rec->len, level, file, func, line, message, args, nargs);
+        ring->head.store(head + 1, std::memory_order_release);  // Publish to the flusher
+        stats_time(&thread_timings::call, start);
+        return;
+    }
+
+    uint64_t locked = stats_clock();
+    pthread_mutex_lock(&log_mutex);  // Lock the mutex for thread safety
+    stats_time(&thread_timings::lock_wait, locked);
+    char buf[BUF_LEN];  // Buffer for constructing the log message
+    uint64_t built = stats_clock();
+    int len = build_record(buf, BUF_LEN, level, file, func, line, message, args, nargs);
+    stats_time(&thread_timings::build, built);
     pthread_mutex_unlock(&log_mutex);  // Unlock the mutex
+    if (len < 0) return;
+    stats_count(&thread_stats::bytes, len);
+    crash_record(buf, len, level, file, func, line, message, args, nargs);
+
+    // Send the log message to the server. Outside the lock, so a thread
+    // waiting under LOG_OVERFLOW_BLOCK does not hold up threads that drop.
+    send_records(buf, len, 1, policy == LOG_OVERFLOW_BLOCK ? overflow_timeout_us.load(std::memory_order_relaxed) : 0);
+    stats_time(&thread_timings::call, start);
+}
+
+/**
+ * Formats a wall-clock time in ns as "hh:mm:ss.uuuuuu", local time.
+ */
+static void format_clock(uint64_t ns, char *out, size_t len) {
+    time_t sec = ns / 1000000000ULL;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    size_t n = strftime(out, len, "%H:%M:%S", &tm);
+    snprintf(out + n, len - n, ".%06u", (unsigned)(ns % 1000000000ULL / 1000));
+}
+
+/**
+ * Logs the summary of a run of repeated records, if it has any, from the
+ * site of the repeated record, e.g. "last message repeated 1200 times
+ * (first 04:48:01.123456, last 04:48:09.654321)". Any thread may call it.
+ */
+static void coalesce_flush(coalesce_state *cs) {
+    pthread_mutex_lock(&cs->lock);
+    uint32_t n = cs->repeats.exchange(0, std::memory_order_acquire);
+    call_site *site = cs->site;
+    uint64_t first = cs->first_ns.load(std::memory_order_relaxed);
+    uint64_t last = cs->last_ns.load(std::memory_order_relaxed);
+    pthread_mutex_unlock(&cs->lock);
+    if (!n) return;
+
+    char from[32], to[32], msg[128];
+    format_clock(first, from, sizeof(from));
+    format_clock(last, to, sizeof(to));
+    snprintf(msg, sizeof(msg), "last message repeated %u times (first %s, last %s)", n, from, to);
+    deliver_record(site->level, site->file, site->func, site->line, msg, NULL, 0);
+}
+
+/**
+ * Folds a record into the calling thread's run when it repeats the
+ * previous record: same call site, interned so the run keeps its own copy
+ * of the strings, and the same message or format arguments. A different
+ * record ends the run; so does the run timeout, while repeats keep arriving
+ * or, for a thread gone quiet, when the receive thread finds the run
+ * expired.
+ *
+ * @return 1 if the record repeats the previous one and was counted, 0 to log it
+ */
+static int coalesce_record(LOG_LEVEL level, const char *file, const char *func, int line, const char *message,
+                           const log_arg *args, int nargs) {
+    call_site *site = intern_site(level, file, func, line, args ? message : NULL);
+    if (!site) return 0;  // Registry full, log as is
+    coalesce_state *cs = local_thread.coalesce;
+    if (!cs) {
+        cs = new (std::nothrow) coalesce_state();
+        if (!cs) return 0;
+        pthread_mutex_init(&cs->lock, NULL);
+        cs->site = NULL;  // Matches nothing
+        pthread_mutex_lock(&coalesce_mutex);  // Only taken once per thread
+        cs->next = coalesce_list;
+        coalesce_list = cs;
+        pthread_mutex_unlock(&coalesce_mutex);
+        local_thread.coalesce = cs;
+    }
+
+    // The message text, or for formats the arguments in wire encoding
+    char encoded[BUF_LEN];
+    const char *key = message;
+    int key_len;
+    if (args) {
+        key_len = log_wire_encode_args((uint8_t *)encoded, sizeof(encoded), level, 0, 0, args, nargs);
+        key = encoded;
+    } else {
+        key_len = strlen(message);
+    }
+    if (key_len < 0 || key_len > BUF_LEN) return 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (cs->site == site && cs->key_len == key_len && memcmp(cs->key, key, key_len) == 0) {
+        cs->last_ns.store(now, std::memory_order_relaxed);
+        // An open run is counted without locking. Opening one takes the lock,
+        // so a summarizer never reads a count without the first_ns it goes with
+        uint32_t n = cs->repeats.load(std::memory_order_relaxed);
+        if (n == 0 || !cs->repeats.compare_exchange_strong(n, n + 1, std::memory_order_release,
+                                                           std::memory_order_relaxed)) {
+            pthread_mutex_lock(&cs->lock);
+            if (cs->repeats.fetch_add(1, std::memory_order_relaxed) == 0) {
+                cs->first_ns.store(now, std::memory_order_relaxed);
+            }
+            pthread_mutex_unlock(&cs->lock);
+        }
+        coalesced.fetch_add(1, std::memory_order_relaxed);
+        // A long run is summarized every timeout, so it shows while it lasts
+        uint64_t timeout = (uint64_t)coalesce_ms.load(std::memory_order_relaxed) * 1000000ULL;
+        if (now - cs->first_ns.load(std::memory_order_relaxed) >= timeout) coalesce_flush(cs);
+        return 1;
+    }
+
+    // A different record: summarize the run and hold this one instead
+    coalesce_flush(cs);
+    pthread_mutex_lock(&cs->lock);
+    cs->site = site;
+    memcpy(cs->key, key, key_len);
+    cs->key_len = key_len;
+    pthread_mutex_unlock(&cs->lock);
+    return 0;
+}
+
+/**
+ * Summarizes the open runs of every thread.
+ */
+static void coalesce_flush_all() {
+    pthread_mutex_lock(&coalesce_mutex);
+    for (coalesce_state *cs = coalesce_list; cs; cs = cs->next) coalesce_flush(cs);
+    pthread_mutex_unlock(&coalesce_mutex);
+}
+
+/**
+ * Summarizes the runs of threads that have not logged for the run timeout.
+ * Called by the receive thread.
+ */
+static void coalesce_expire() {
+    uint64_t timeout = (uint64_t)coalesce_ms.load(std::memory_order_relaxed) * 1000000ULL;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    pthread_mutex_lock(&coalesce_mutex);
+    for (coalesce_state *cs = coalesce_list; cs; cs = cs->next) {
+        if (cs->repeats.load(std::memory_order_relaxed) &&
+            now - cs->last_ns.load(std::memory_order_relaxed) >= timeout) {
+            coalesce_flush(cs);
+        }
+    }
+    pthread_mutex_unlock(&coalesce_mutex);
+}
+
+/**
+ * Applies coalescing and rate limits to a record that passed the level
+ * filter, then delivers it.
+ *
+ * @param args Captured arguments when message is a format, else NULL
+ */
+static void submit_record(LOG_LEVEL level, const char *file, const char *func, int line,
+                          const char *message, const log_arg *args, int nargs) {
+    if (coalesce_ms.load(std::memory_order_relaxed) && coalesce_record(level, file, func, line, message, args, nargs)) {
+        return;
+    }
+    if (rate_limits_on.load(std::memory_order_relaxed)) {
+        call_site *site = intern_site(level, file, func, line, args ? message : NULL);
+        if (site && rate_limited(site)) {
+            crash_record(NULL, 0, level, file, func, line, message, args, nargs);
+            return;
+        }
+    }
+    deliver_record(level, file, func, line, message, args, nargs);
 }
 
 /**
@@ -135,29 +2010,162 @@ void SetLogLevel(LOG_LEVEL level) {
  * @param message The log message to send
  */
 void Log(LOG_LEVEL level, const char *file, const char *func, int line, const char *message) {
-    pthread_mutex_lock(&log_mutex);  // Lock the mutex for thread safety
-    if (level < log_filter) {        // If the log level is below the filter level, return without logging
-        pthread_mutex_unlock(&log_mutex);
-        return;
+    if (!LOG_ENABLED(level)) {
+        count_filtered();
+        return;  // Below the filter level, return without logging
+    }
+    submit_record(level, file, func, line, message, NULL, 0);
+}
+
+/**
+ * Logs a printf-style format with arguments captured by Logf(). In text
+ * mode the arguments are formatted straight into the outgoing record; in
+ * binary mode they are sent raw and LogServer formats them.
+ *
+ * @param level Log level for the message (DEBUG, WARNING, ERROR, CRITICAL)
+ * @param file Name of the source file from which the log is generated
+ * @param func Name of the function from which the log is generated
+ * @param line Line number in the source file where the log is generated
+ * @param fmt printf-style format string
+ * @param args Captured arguments
+ * @param nargs Number of entries in args
+ */
+void LogArgs(LOG_LEVEL level, const char *file, const char *func, int line, const char *fmt,
+             const log_arg *args, int nargs) {
+    if (!LOG_ENABLED(level)) {
+        count_filtered();
+        return;  // Below the filter level, return without logging
     }
+    submit_record(level, file, func, line, fmt, args, nargs);
+}
 
-    // Get the current time and format it
-    time_t now = time(0);
-    char *time_str = ctime(&now);
-    time_str[strcspn(time_str, "\n")] = '\0';  // Remove newline character from the time string
+/**
+ * Reads the delivery counters of this process. Records lost in the
+ * network are not visible here; the server counts those from the gaps
+ * in the sequence numbers.
+ *
+ * @param out Filled with the counters since InitializeLog()
+ */
+void GetLogCounters(log_counters *out) {
+    out->sent = sent_records.load(std::memory_order_relaxed);
+    out->eagain = drop_eagain.load(std::memory_order_relaxed);
+    out->enobufs = drop_enobufs.load(std::memory_order_relaxed);
+    out->errors = drop_error.load(std::memory_order_relaxed);
+    out->ring_full = drop_ring.load(std::memory_order_relaxed);
+    out->overwritten = drop_oldest.load(std::memory_order_relaxed);
+    out->sampled = drop_sampled.load(std::memory_order_relaxed);
+    out->blocked = block_waits.load(std::memory_order_relaxed);
+    out->timeouts = drop_timeout.load(std::memory_order_relaxed);
+    out->packed_in = packed_in.load(std::memory_order_relaxed);
+    out->packed_out = packed_out.load(std::memory_order_relaxed);
+    out->suppressed = rate_suppressed.load(std::memory_order_relaxed);
+    out->coalesced = coalesced.load(std::memory_order_relaxed);
+    out->truncated = truncated.load(std::memory_order_relaxed);
+}
 
-    // Log level names
-    char level_str[][16] = {"DEBUG", "WARNING", "ERROR", "CRITICAL"};
-    char buf[BUF_LEN];  // Buffer for constructing the log message
-    int len = snprintf(buf, BUF_LEN, "%s %s %s:%s:%d %s", time_str, level_str[level], file, func, line, message);
-    if (len < 0) {
-        pthread_mutex_unlock(&log_mutex);  // Unlock the mutex if snprintf fails
-        return;
+/**
+ * Turns the latency histograms of GetLogStats() on or off; counters are
+ * always kept. Timing costs a few clock reads per record, so it is off by
+ * default. May be called at any time.
+ *
+ * @param enable 1 to record timings, 0 to stop
+ */
+void SetLogStats(int enable) {
+    stats_timing.store(enable != 0, std::memory_order_relaxed);
+}
+
+/**
+ * Summarizes a histogram for log_stats.
+ */
+static void summarize(const log_histogram *h, log_latency *out) {
+    out->count = h->count;
+    out->mean_ns = h->count ? h->sum / h->count : 0;
+    out->p50_ns = log_hist_percentile(h, 0.5);
+    out->p99_ns = log_hist_percentile(h, 0.99);
+    out->p999_ns = log_hist_percentile(h, 0.999);
+    out->max_ns = h->max;
+}
+
+/**
+ * Aggregates the hot-path statistics of every thread that logged, exited
+ * threads included. Cheap for the logging threads: each keeps its own
+ * counters and they are only summed here. Filtered calls of a live thread
+ * show up in steps of FILTERED_BATCH.
+ *
+ * @param out Filled with the statistics since the process started
+ */
+void GetLogStats(log_stats *out) {
+    thread_stats *sum = new (std::nothrow) thread_stats();
+    memset(out, 0, sizeof(*out));
+    if (!sum) return;
+    pthread_mutex_lock(&stats_mutex);
+    merge_stats(sum, &stats_retired);
+    for (thread_stats *st = stats_list; st; st = st->next) {
+        merge_stats(sum, st);
+        out->threads++;
     }
+    pthread_mutex_unlock(&stats_mutex);
 
-    // Send the log message to the server
-    sendto(send_socket, buf, len, 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    pthread_mutex_unlock(&log_mutex);  // Unlock the mutex
+    out->calls = sum->calls;
+    out->filtered = stats_filtered.load(std::memory_order_relaxed);
+    out->bytes = sum->bytes;
+    out->datagrams = sum->datagrams;
+    if (sum->timings) {
+        summarize(&sum->timings->build, &out->build);
+        summarize(&sum->timings->lock_wait, &out->lock_wait);
+        summarize(&sum->timings->send, &out->send);
+        summarize(&sum->timings->call, &out->call);
+    }
+    delete sum->timings;
+    delete sum;
+}
+
+/**
+ * Sends a summary record when records were dropped since the last call,
+ * e.g. "120 log records dropped (socket full 0, ring full 120, ...)".
+ * It goes straight to the socket so a full ring cannot swallow it.
+ */
+static void report_drops() {
+    static log_counters last;  // Only touched by the receive thread and ExitLog()
+    log_counters now;
+    GetLogCounters(&now);
+    unsigned long long socket = (now.eagain - last.eagain) + (now.enobufs - last.enobufs) +
+                                (now.errors - last.errors);
+    unsigned long long ring = now.ring_full - last.ring_full;
+    unsigned long long overwritten = now.overwritten - last.overwritten;
+    unsigned long long sampled = now.sampled - last.sampled;
+    unsigned long long timeouts = now.timeouts - last.timeouts;
+    unsigned long long total = socket + ring + overwritten + sampled + timeouts;
+    if (total == 0) return;
+    last = now;
+
+    char msg[256];
+    snprintf(msg, sizeof(msg),
+             "%llu log records dropped (socket full %llu, ring full %llu, overwritten %llu, "
+             "sampled %llu, timed out %llu)",
+             total, socket, ring, overwritten, sampled, timeouts);
+    char buf[BUF_LEN];
+    int len = build_record(buf, BUF_LEN, WARNING, "Logger", __func__, __LINE__, msg, NULL, 0);
+    if (len >= 0) send_records(buf, len, 1, 0);
+}
+
+/**
+ * Sends one record per call site whose records the rate limit suppressed
+ * since the last call, from that site, e.g. "[rate limit] 4500 records
+ * suppressed". They go straight to the socket like report_drops().
+ */
+static void report_suppressed() {
+    if (!rate_suppressed.load(std::memory_order_relaxed)) return;
+    for (uint32_t i = 0; i < SITE_TABLE_SIZE; i++) {
+        call_site *site = site_table[i].load(std::memory_order_acquire);
+        if (!site || !site->suppressed.load(std::memory_order_relaxed)) continue;
+        uint64_t n = site->suppressed.exchange(0, std::memory_order_relaxed);
+        char msg[64];
+        snprintf(msg, sizeof(msg), "[rate limit] %llu records suppressed", (unsigned long long)n);
+        char buf[BUF_LEN];
+        int len = build_record(buf, BUF_LEN, site->level, site->file, site->func, site->line, msg, NULL, 0);
+        if (len >= 0) send_records(buf, len, 1, 0);
+    }
 }
 
 /**
@@ -166,6 +2174,34 @@ void Log(LOG_LEVEL level, const char *file, const char *func, int line, const ch
 void ExitLog() {
     server_running = 0;  // Stop the server loop
     pthread_join(recv_thread, NULL);  // Wait for the receive thread to finish
+    coalesce_flush_all();  // Summarize the runs still open while the flusher can send them
+    if (log_mode == LOG_MODE_ASYNC) {
+        flusher_running.store(0, std::memory_order_release);
+        pthread_join(flush_thread, NULL);  // Flusher sends what is still queued
+        free(batch.data);
+        batch.data = NULL;
+
+        // Detach the rings of threads that are still alive. Each is freed
+        // by whichever of ExitLog() and its owner lets go of it last.
+        pthread_mutex_lock(&ring_mutex);
+        while (ring_list) {
+            log_ring *ring = ring_list;
+            ring_list = ring->next;
+            ring->detached.store(1, std::memory_order_relaxed);
+            release_ring(ring);
+        }
+        pthread_mutex_unlock(&ring_mutex);
+    }
+    report_drops();  // Account for what the last interval lost
+    report_suppressed();
+    log_crash_header *crash = crash_ring.exchange(NULL, std::memory_order_acq_rel);
+    if (crash) {
+        // Clean exit, nothing to recover. A thread that read crash_ring
+        // just before it was cleared may still be writing a record, so the
+        // segment is swapped for anonymous memory rather than unmapped.
+        shm_unlink(crash_name);
+        mmap(crash, crash_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    }
     close(send_socket);  // Close the sending socket
     close(recv_socket);  // Close the receiving socket
     pthread_mutex_destroy(&log_mutex);  // Destroy the mutex
@@ -3,6 +3,10 @@
 
 #include <pthread.h>
 #include <string>
+#include <atomic>
+#include <type_traits>
+#include <string.h>
+#include "LogProtocol.h"
 
 // Log severity levels
 enum LOG_LEVEL {
@@ -12,10 +16,229 @@ enum LOG_LEVEL {
     CRITICAL = 3
 };
 
+// Delivery modes for Log()
+enum LOG_MODE {
+    LOG_MODE_SYNC = 0,   // Format and send on the calling thread (default)
+    LOG_MODE_ASYNC = 1   // Copy into a per-thread ring, a flusher thread sends
+};
+
+// Wire format of log records
+enum LOG_FORMAT {
+    LOG_FORMAT_TEXT = 0,   // Human-readable line formatted by the client (default)
+    LOG_FORMAT_BINARY = 1  // Compact record (see LogProtocol.h) rendered by LogServer
+};
+
+// How records reach LogServer, see SetLogTransport()
+enum LOG_TRANSPORT {
+    LOG_TRANSPORT_UDP = 0,   // UDP to SERVER_IP (default)
+    LOG_TRANSPORT_UNIX = 1,  // Unix datagram socket, server on the same host
+    LOG_TRANSPORT_SHM = 2    // Shared-memory ring, server on the same host
+};
+
+// Sub-second digits in record timestamps
+enum LOG_TIME_PRECISION {
+    LOG_TIME_SEC = 0,    // Whole seconds, read from CLOCK_REALTIME_COARSE
+    LOG_TIME_MSEC = 3,   // Milliseconds
+    LOG_TIME_USEC = 6,   // Microseconds (default)
+    LOG_TIME_NSEC = 9    // Nanoseconds
+};
+
+// What happens to a record when the local queue or the socket is full,
+// see SetLogOverflow()
+enum LOG_OVERFLOW {
+    LOG_OVERFLOW_DROP_NEWEST = 0,  // Drop the new record (default)
+    LOG_OVERFLOW_DROP_OLDEST = 1,  // Async mode: discard the oldest queued record instead
+    LOG_OVERFLOW_BLOCK = 2,        // Wait for room up to the timeout, then drop the new record
+    LOG_OVERFLOW_SAMPLE = 3        // Async mode: keep 1 in N records once the queue is half full
+};
+
+// Current log level filter, written by SetLogLevel() and server commands
+extern std::atomic<int> log_filter;
+
+// Fast-path check so disabled levels cost a single load and branch, e.g.
+// if (LOG_ENABLED(DEBUG)) { build message; Log(DEBUG, ...); }
+#define LOG_ENABLED(level) ((int)(level) >= log_filter.load(std::memory_order_relaxed))
+
+// Lowest level compiled into the binary. Calls through the LOG_* macros
+// below this level are discarded at compile time, arguments included.
+// Override with e.g. -DLOG_COMPILE_LEVEL=WARNING for release builds.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL DEBUG
+#endif
+
+// Returns the part of a path after the last '/', evaluated at compile time
+// when given __FILE__
+constexpr const char *LogBasename(const char *path) {
+    const char *base = path;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/') base = p + 1;
+    }
+    return base;
+}
+
+// Logs a printf-style format from the current call site, e.g.
+// LOG_WARNING("retry %d of %d", n, max). File, function and line are
+// captured as constants, nothing is evaluated unless the level is enabled,
+// and the format is checked against the arguments at compile time.
+#define LOG_AT(level, ...)                                                  \
+    do {                                                                    \
+        if constexpr ((level) >= LOG_COMPILE_LEVEL) {                       \
+            if (LOG_ENABLED(level)) {                                       \
+                if (0) LogCheckFormat(__VA_ARGS__);                         \
+                static constexpr const char *log_file_ = LogBasename(__FILE__); \
+                Logf(level, log_file_, __func__, __LINE__, __VA_ARGS__);    \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(DEBUG, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(WARNING, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(ERROR, __VA_ARGS__)
+#define LOG_CRITICAL(...) LOG_AT(CRITICAL, __VA_ARGS__)
+
+// Delivery counters of this process, see GetLogCounters()
+struct log_counters {
+    unsigned long long sent;       // Records handed to the kernel
+    unsigned long long eagain;     // Records dropped because the socket buffer was full
+    unsigned long long enobufs;    // Records dropped for lack of kernel memory
+    unsigned long long errors;     // Records dropped by other send errors
+    unsigned long long ring_full;  // Records dropped because a thread's ring was full
+    unsigned long long overwritten; // Queued records discarded by LOG_OVERFLOW_DROP_OLDEST
+    unsigned long long sampled;    // Records skipped by LOG_OVERFLOW_SAMPLE
+    unsigned long long blocked;    // Times LOG_OVERFLOW_BLOCK made a caller wait
+    unsigned long long timeouts;   // Records dropped after waiting the whole timeout
+    unsigned long long packed_in;  // Payload bytes offered to SetLogCompression()
+    unsigned long long packed_out; // Bytes actually sent for them
+    unsigned long long suppressed; // Records held back by SetLogRateLimit() limits
+    unsigned long long coalesced;  // Repeated records folded into SetLogCoalescing() summaries
+    unsigned long long truncated;  // Text records cut at the SetLogMaxRecord() limit
+};
+
+// Latency of one instrumented step, in nanoseconds. Percentiles are
+// accurate to about 6%.
+struct log_latency {
+    unsigned long long count;
+    unsigned long long mean_ns;
+    unsigned long long p50_ns;
+    unsigned long long p99_ns;
+    unsigned long long p999_ns;
+    unsigned long long max_ns;
+};
+
+// Hot-path statistics of this process, see GetLogStats()
+struct log_stats {
+    unsigned long long calls;      // Records past the level filter
+    unsigned long long filtered;   // Log()/LogArgs() calls below it; LOG_* macros filter inline, uncounted
+    unsigned long long bytes;      // Bytes of records built
+    unsigned long long datagrams;  // Datagrams handed to the transport
+    int threads;                   // Live threads that logged or sent
+    log_latency build;             // Formatting or encoding a record
+    log_latency lock_wait;         // Waiting for the logger mutex (LOG_MODE_SYNC)
+    log_latency send;              // One send call, sendmsg()/sendmmsg() or the shared-memory ring
+    log_latency call;              // A record from the call until queued (async) or sent (sync)
+};
+
 // Logger functions
+void SetLogMode(LOG_MODE mode);  // Must be called before InitializeLog()
+void SetLogBatching(int max_records, int max_bytes, int max_delay_us, int mtu);  // Before InitializeLog()
+void SetLogFormat(LOG_FORMAT format);  // Must be called before InitializeLog()
+void SetLogTimePrecision(LOG_TIME_PRECISION precision);
+void SetLogMaxRecord(int bytes);  // Any time
+void SetLogClientId(const char *id, const char *group);  // Before InitializeLog()
+void SetLogTransport(LOG_TRANSPORT transport);  // Before InitializeLog()
+void SetLogCompression(int enable);  // Before InitializeLog()
+void SetLogOverflow(LOG_OVERFLOW policy, int timeout_us, int sample_n);
+void SetLogThreadOverflow(LOG_OVERFLOW policy);  // Calling thread only
+void SetLogCrashRing(const char *name, int records);  // Before InitializeLog()
+void SetLogRateLimit(int per_sec, int burst, int sample_n);  // Every call site, any time
+int SetLogSiteRateLimit(const char *file, int line, int per_sec, int burst, int sample_n);
+void SetLogCoalescing(int timeout_ms);  // Any time
 int InitializeLog();
 void SetLogLevel(LOG_LEVEL level);
 void Log(LOG_LEVEL level, const char *prog, const char *func, int line, const char *message);
+void LogArgs(LOG_LEVEL level, const char *file, const char *func, int line, const char *fmt,
+             const log_arg *args, int nargs);
+void GetLogCounters(log_counters *out);
+void SetLogStats(int enable);  // Latency histograms, any time
+void GetLogStats(log_stats *out);
 void ExitLog();
 
+// Never called; gives the compiler's printf checking a view of LOG_* formats
+inline void LogCheckFormat(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+inline void LogCheckFormat(const char *, ...) {}
+
+// What LogMakeArg() captures for a null string, so %p still prints null
+inline constexpr char LogNullString[] = "(null)";
+
+// Captures one format argument by type without formatting it
+template <typename T>
+inline log_arg LogMakeArg(const T &value) {
+    typedef typename std::decay<T>::type V;
+    log_arg arg;
+    arg.len = 0;
+    if constexpr (std::is_floating_point<V>::value) {
+        arg.type = LOG_ARG_DOUBLE;
+        arg.d = value;
+    } else if constexpr (std::is_integral<V>::value || std::is_enum<V>::value) {
+        if constexpr (std::is_signed<V>::value || std::is_enum<V>::value) {
+            arg.type = LOG_ARG_INT;
+            arg.i = (int64_t)value;
+        } else {
+            arg.type = LOG_ARG_UINT;
+            arg.u = (uint64_t)value;
+        }
+    } else if constexpr (std::is_convertible<V, const char *>::value) {
+        const char *s = value;
+        arg.type = LOG_ARG_STRING;
+        arg.s = s ? s : LogNullString;
+        arg.len = strlen(arg.s);
+    } else {
+        static_assert(std::is_pointer<V>::value, "unsupported log argument type");
+        arg.type = LOG_ARG_PTR;
+        arg.u = (uint64_t)(uintptr_t)value;
+    }
+    return arg;
+}
+
+// Turns the string arguments of %p conversions back into pointers.
+// LogMakeArg() does not see the format, so it captures every character
+// pointer as a string.
+inline void LogCapturePointers(const char *fmt, log_arg *args, int nargs) {
+    int next = 0;
+    for (const char *p = fmt; *p && next < nargs;) {
+        if (*p++ != '%') continue;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+        // Flags, width, precision and length up to the conversion; '*'
+        // takes an argument
+        while (*p && !strchr("diouxXcspeEfFgGaA", *p)) {
+            if (*p == '*') next++;
+            p++;
+        }
+        if (!*p) break;
+        if (*p++ == 'p' && next < nargs && args[next].type == LOG_ARG_STRING) {
+            args[next].type = LOG_ARG_PTR;
+            args[next].u = args[next].s == LogNullString ? 0 : (uint64_t)(uintptr_t)args[next].s;
+        }
+        next++;
+    }
+}
+
+// Logs a printf-style format. The level is checked before anything else;
+// arguments are captured in binary form and only formatted for enabled
+// records, either into the outgoing record or by LogServer.
+template <typename... Args>
+inline void Logf(LOG_LEVEL level, const char *file, const char *func, int line, const char *fmt,
+                 const Args &...args) {
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+    if (!LOG_ENABLED(level)) return;
+    log_arg captured[sizeof...(Args) + 1] = {LogMakeArg(args)..., log_arg()};
+    if constexpr ((std::is_convertible<typename std::decay<Args>::type, const char *>::value || ...)) {
+        LogCapturePointers(fmt, captured, sizeof...(Args));
+    }
+    LogArgs(level, file, func, line, fmt, captured, sizeof...(Args));
+}
+
 #endif // LOGGER_H